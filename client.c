@@ -1,7 +1,16 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <math.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/XShm.h>
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
 #include <pango/pangocairo.h>
@@ -12,6 +21,7 @@
 #include "log.h"
 #include "macros.h"
 #include "manager.h"
+#include "metrics.h"
 #include "monitor.h"
 #include "settings.h"
 #include "x11.h"
@@ -19,15 +29,211 @@
 /* icons are 40% of the button size */
 #define IconScaleFactor 0.4f
 
+/* topbar background pixmaps widths are multiple of it */
+#define BackgroundStep 256
+
+/* longest title shown, in bytes */
+#define TitleMaxLength 256
+
+/* threads shaping and rasterising titles */
+#define TitleWorkerCount 2
+
+/* shared memory images are uploaded through, enough for a few HiDPI
+ * titles */
+#define ShmArenaSize (4 << 20)
+
+typedef struct TitleJob TitleJob;
+
+/* a title rendering, queued to the workers then handed back to the
+ * event loop which uploads it if the client still wants it */
+struct TitleJob {
+    Window window;
+    unsigned long serial;
+    char text[TitleMaxLength + 1];
+    int w, h, fg, bg;
+    cairo_surface_t *image;
+    TitleJob *next;
+};
+
+/* rows of the button atlas, buttons being its columns. Titles use
+ * the non hovered states */
+enum ButtonStates {
+    ButtonStateUrgent,
+    ButtonStateActive,
+    ButtonStateActiveHovered,
+    ButtonStateInactive,
+    ButtonStateInactiveHovered,
+    ButtonStateCount
+};
+
 static void ApplyNormalHints(Client *c);
+static void PlacePart(Client *c, int part, Window w,
+        int x, int y, int width, int height);
+static void SetClientMapped(Client *c, Bool b);
+static void AssignClientDesktop(Client *c, int desktop);
 static void GetTopbarGeometry(Client *c, int *x, int *y, int *w, int *h);
 static void GetButtonGeometry(Client *c, int button, int *x, int *y, int *w, int *h);
 static void SetSourceColor(cairo_t *cairo, int color);
-static void DrawFrame(Client *c, cairo_t *cairo);
-static void WriteTitle(Client *c, cairo_t *cairo);
-static void DrawButton(Client *c, cairo_t *cairo, int button);
+static int GetBorderColor(Client *c);
+static int GetStateBackground(int state);
+static unsigned long GetPixel(int color);
+static void WriteTitle(Client *c);
+static void RenderTitle(TitleJob *j, PangoLayout *layout);
+static void UploadImage(cairo_surface_t *image, Drawable d, int w, int h);
+static Bool UploadShmImage(cairo_surface_t *image, Drawable d, int w, int h);
+static void SetupShm();
+static void CleanupShm();
+static int ShmErrorHandler(Display *d, XErrorEvent *e);
+static int GetTitleLength(const char *name);
+static void ReceiveClientProperties(Client *c);
+static void DiscardClientProperties(Client *c);
+static void OnNameTimer(void *data);
+static void DrawButton(cairo_t *cairo, int button, int state,
+        int x, int y, int w, int h);
+static int GetButtonState(Client *c, int button);
+static void CreateButtonAtlas();
+static void SetupTitleWorkers();
+static void CleanupTitleWorkers();
+static void *RunTitleWorker(void *arg);
+static void RequestTitle(Client *c, int w, int h, int state);
+static void ReceiveTitles();
+static Client *CompleteTitle(TitleJob *j);
+static PangoLayout *CreateTitleLayout(PangoContext *context);
+static PangoContext *CreateFontContext();
 
 Client *clients = NULL; 
+long stackCount = 0;
+
+/* clients waiting for property replies */
+static int fetchingCount = 0;
+
+/* clients waiting for their decorations to be repainted */
+static Client *dirtyClients = NULL;
+
+/* fonts are resolved once, icons are the same for every client */
+static PangoContext *pangoContext = NULL;
+static PangoFontDescription *labelFont = NULL;
+static PangoFontDescription *iconFont = NULL;
+static PangoLayout *iconLayouts[ButtonCount];
+
+/* screen antialiasing, hinting and dpi, given to every context */
+static cairo_font_options_t *fontOptions = NULL;
+static double fontResolution = 96.0;
+
+/* every button in every state rendered once, painting a button is
+ * copying its cell */
+static Pixmap buttonAtlas = None;
+static GC decorationGC = None;
+
+/* topbar fills, one per button state */
+static GC backgroundGCs[ButtonStateCount];
+
+/* images are written one after the other in the shared segment,
+ * which is reused once the server completed every pending upload */
+static XShmSegmentInfo shmSegment;
+static Bool hasShm = False;
+static Bool shmFailed = False;
+static size_t shmUsed = 0;
+static int shmPending = 0;
+
+/* pending jobs are shared under the lock, finished ones are pushed
+ * without it and the event loop is woken through the pipe */
+static pthread_t titleWorkers[TitleWorkerCount];
+static int titleWorkerCount = 0;
+static pthread_mutex_t titleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t titleCondition = PTHREAD_COND_INITIALIZER;
+static TitleJob *pendingTitles = NULL;
+static Bool stopTitleWorkers = False;
+static _Atomic(TitleJob *) finishedTitles = NULL;
+static int titlePipe[2] = { -1, -1 };
+static unsigned long titleSerial = 0;
+static PangoLayout *titleLayout = NULL;
+
+static Probe showClientProbe = { .name = "ShowClient" };
+static Probe refreshClientProbe = { .name = "RefreshClient" };
+
+void
+SetupDecorations()
+{
+    cairo_surface_t *surface;
+    char *dpi;
+
+    /* the font options of a screen surface follow the Xft resources */
+    surface = cairo_xlib_surface_create(display, root,
+            DefaultVisual(display, DefaultScreen(display)), 1, 1);
+    fontOptions = cairo_font_options_create();
+    cairo_surface_get_font_options(surface, fontOptions);
+    cairo_surface_destroy(surface);
+    dpi = XGetDefault(display, "Xft", "dpi");
+    fontResolution = dpi && atof(dpi) > 0 ? atof(dpi) : 96.0;
+
+    pangoContext = CreateFontContext();
+    labelFont = pango_font_description_from_string(settings.labelFontname);
+    iconFont = pango_font_description_from_string(settings.iconFontname);
+
+    for (int i = 0; i < ButtonCount; ++i) {
+        iconLayouts[i] = NULL;
+        if (strlen(settings.buttonStyles[i].icon)) {
+            iconLayouts[i] = pango_layout_new(pangoContext);
+            pango_layout_set_font_description(iconLayouts[i], iconFont);
+            pango_layout_set_text(iconLayouts[i],
+                    settings.buttonStyles[i].icon, -1);
+        }
+    }
+
+    decorationGC = XCreateGC(display, root, 0, NULL);
+    for (int s = 0; s < ButtonStateCount; ++s) {
+        XGCValues v;
+        v.foreground = GetPixel(GetStateBackground(s));
+        backgroundGCs[s] = XCreateGC(display, root, GCForeground, &v);
+    }
+    CreateButtonAtlas();
+    SetupShm();
+    SetupTitleWorkers();
+}
+
+void
+CleanupDecorations()
+{
+    CleanupTitleWorkers();
+    CleanupShm();
+
+    if (buttonAtlas != None)
+        XFreePixmap(display, buttonAtlas);
+    buttonAtlas = None;
+
+    if (decorationGC != None)
+        XFreeGC(display, decorationGC);
+    decorationGC = None;
+
+    for (int s = 0; s < ButtonStateCount; ++s) {
+        if (backgroundGCs[s] != None)
+            XFreeGC(display, backgroundGCs[s]);
+        backgroundGCs[s] = None;
+    }
+
+    for (int i = 0; i < ButtonCount; ++i) {
+        if (iconLayouts[i])
+            g_object_unref(iconLayouts[i]);
+        iconLayouts[i] = NULL;
+    }
+
+    if (labelFont)
+        pango_font_description_free(labelFont);
+    labelFont = NULL;
+
+    if (iconFont)
+        pango_font_description_free(iconFont);
+    iconFont = NULL;
+
+    if (pangoContext)
+        g_object_unref(pangoContext);
+    pangoContext = NULL;
+
+    if (fontOptions)
+        cairo_font_options_destroy(fontOptions);
+    fontOptions = NULL;
+}
 
 void
 KillClient(Client *c)
@@ -39,7 +245,7 @@ KillClient(Client *c)
         XSetErrorHandler(DisableErrorHandler);
         XSetCloseDownMode(display, DestroyAll);
         XKillClient(display, c->window);
-        XSync(display, False);
+        SyncDisplay(False);
         XSetErrorHandler(EnableErrorHandler);
         XUngrabServer(display);
     }
@@ -50,11 +256,18 @@ HideClient(Client *c)
 {
     c->isVisible = False;
 
+    /* unmapped clients know they are not shown and may stop drawing */
+    if (settings.unmapHidden) {
+        if (c->isMapped)
+            SetClientMapped(c, False);
+        return;
+    }
+
     /* move all windows off screen without changing anything */
-    XMoveWindow(display, c->frame, -c->fw, c->fy);
+    PlacePart(c, PartFrame, c->frame, -c->fw, c->fy, 0, 0);
     if (c->hasHandles)
         for (int i = 0; i < HandleCount; ++i)
-            XMoveWindow(display, c->handles[i], -c->fw, c->fy);
+            PlacePart(c, PartHandle + i, c->handles[i], -c->fw, c->fy, 0, 0);
 }
 
 void
@@ -63,59 +276,76 @@ ShowClient(Client *c)
     int wx, wy, bw;
     XEvent ce;
 
+    EnterProbe(&showClientProbe);
     c->isVisible = True;
 
+    /* catch up with what changed while hidden, without waiting */
+    RequestStaleProperties(c);
+
     /* what is the border width */
     bw = c->isBorderVisible ? settings.borderWidth : 0;
 
+    /* the border is the one of the frame window, painted by the
+     * server, its children are placed inside of it */
+    if (c->frameBorder != bw) {
+        XSetWindowBorderWidth(display, c->frame, bw);
+        c->frameBorder = bw;
+    }
+
     /* compute the relative window's position */
-    wx = c->wx - c->fx;
-    wy = c->wy - c->fy;
+    wx = c->wx - c->fx - bw;
+    wy = c->wy - c->fy - bw;
 
-    /* place frame and window */
-    XMoveResizeWindow(display, c->frame, c->fx, c->fy, c->fw, c->fh);
-    XMoveResizeWindow(display, c->window, wx, wy, c->ww, c->wh);
+    /* place frame and window, only what changed is sent */
+    PlacePart(c, PartFrame, c->frame, c->fx, c->fy,
+            c->fw - 2 * bw, c->fh - 2 * bw);
+    PlacePart(c, PartWindow, c->window, wx, wy, c->ww, c->wh);
 
     /* place the topbar */
     if (c->hasTopbar) {
         if (c->isTopbarVisible) {
             int x, y, w, h;
             GetTopbarGeometry(c, &x, &y, &w, &h);
-            XMoveResizeWindow(display, c->topbar, x, y, w, h);
+            PlacePart(c, PartTopbar, c->topbar, x, y, w, h);
             for (int i = 0; i < ButtonCount; ++i) {
                 GetButtonGeometry(c, i, &x, &y, &w, &h);
-                XMoveResizeWindow(display, c->buttons[i], x, y, w, h); 
+                PlacePart(c, PartButton + i, c->buttons[i], x, y, w, h);
             }
         } else {
             /* move the topbar outside the frame */
-            XMoveWindow(display, c->topbar, bw, -(bw + settings.topbarHeight));
+            PlacePart(c, PartTopbar, c->topbar,
+                    0, -settings.topbarHeight, 0, 0);
         }
     }
 
     /* suround frame by handles */
     if (c->hasHandles) {
         int hw = settings.handleWidth;
-        XMoveResizeWindow(display, c->handles[HandleNorth],
+        PlacePart(c, PartHandle + HandleNorth, c->handles[HandleNorth],
                 c->fx, c->fy - hw, c->fw, hw);
-        XMoveResizeWindow(display, c->handles[HandleNorthWest],
+        PlacePart(c, PartHandle + HandleNorthWest, c->handles[HandleNorthWest],
                 c->fx + c->fw, c->fy - hw, hw, hw);
-        XMoveResizeWindow(display, c->handles[HandleWest],
+        PlacePart(c, PartHandle + HandleWest, c->handles[HandleWest],
                 c->fx + c->fw, c->fy, hw, c->fh);
-        XMoveResizeWindow(display, c->handles[HandleSouthWest],
+        PlacePart(c, PartHandle + HandleSouthWest, c->handles[HandleSouthWest],
                 c->fx + c->fw, c->fy + c->fh, hw, hw);
-        XMoveResizeWindow(display, c->handles[HandleSouth],
+        PlacePart(c, PartHandle + HandleSouth, c->handles[HandleSouth],
                 c->fx, c->fy + c->fh, c->fw, hw);
-        XMoveResizeWindow(display, c->handles[HandleSouthEast],
+        PlacePart(c, PartHandle + HandleSouthEast, c->handles[HandleSouthEast],
                 c->fx - hw, c->fy + c->fh, hw, hw);
-        XMoveResizeWindow(display, c->handles[HandleEast],
+        PlacePart(c, PartHandle + HandleEast, c->handles[HandleEast],
                 c->fx - hw, c->fy, hw, c->fh);
-        XMoveResizeWindow(display, c->handles[HandleNorthEast],
+        PlacePart(c, PartHandle + HandleNorthEast, c->handles[HandleNorthEast],
                 c->fx - hw, c->fy - hw, hw, hw);
     }
-    RefreshClient(c);
+    /* placed before being mapped again */
+    if (!c->isMapped)
+        SetClientMapped(c, True);
+
+    InvalidateClient(c);
 
     /* synchronize transients */
-    Desktop *d = &c->monitor->desktops[c->desktop];
+    Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
     for (Transient *t = c->transients; t; t = t->next) {
         int x, y, w, h;
         w = Min(d->ww, t->client->fw);
@@ -123,10 +353,19 @@ ShowClient(Client *c)
         x = Min(Max(d->wx, c->fx + (c->fw - t->client->fw) / 2), d->wx + d->ww - w);
         y = Min(Max(d->wy, c->fy + (c->fh - t->client->fh) / 2), d->wy + d->wh - h);
         MoveResizeClientFrame(t->client, x, y, w, h, False);
-        RefreshClient(t->client);
+        InvalidateClient(t->client);
     }
 
-    /* let anybody knows about the changes */
+    /* let anybody knows about the changes, if any */
+    if (c->nx == c->wx && c->ny == c->wy && c->nw == c->ww && c->nh == c->wh) {
+        LeaveProbe(&showClientProbe);
+        return;
+    }
+    c->nx = c->wx;
+    c->ny = c->wy;
+    c->nw = c->ww;
+    c->nh = c->wh;
+
     memset(&ce, 0, sizeof(ce));
     ce.xconfigure.display = display;
     ce.xconfigure.type = ConfigureNotify;
@@ -140,7 +379,64 @@ ShowClient(Client *c)
     ce.xconfigure.above = None;
     ce.xconfigure.override_redirect = False;
     XSendEvent(display, c->window, False, StructureNotifyMask, &ce);
-    XSync(display, False);
+    LeaveProbe(&showClientProbe);
+}
+
+void
+SetClientMapped(Client *c, Bool b)
+{
+    long state[] = {b ? NormalState : IconicState, None};
+
+    if (b) {
+        XMapWindow(display, c->window);
+        XMapWindow(display, c->frame);
+        if (c->hasHandles)
+            for (int i = 0; i < HandleCount; ++i)
+                XMapWindow(display, c->handles[i]);
+    } else {
+        /* the UnmapNotify this causes is not a withdrawal */
+        c->unmapSerial = NextRequest(display);
+        XUnmapWindow(display, c->window);
+        XUnmapWindow(display, c->frame);
+        if (c->hasHandles)
+            for (int i = 0; i < HandleCount; ++i)
+                XUnmapWindow(display, c->handles[i]);
+    }
+
+    XChangeProperty(display, c->window, atoms[AtomWMState],
+            atoms[AtomWMState], 32, PropModeReplace,
+            (unsigned char *)state, 2);
+    c->isMapped = b;
+}
+
+void
+PlacePart(Client *c, int part, Window w, int x, int y, int width, int height)
+{
+    XWindowChanges wc = { .x = x, .y = y, .width = width, .height = height };
+    int *p = c->placed[part];
+    Bool known = p[2] > 0;  /* nothing is known before the first resize */
+    unsigned int mask = 0;
+
+    /* a size of 0 keeps the current one */
+    if (!known || p[0] != x)
+        mask |= CWX;
+    if (!known || p[1] != y)
+        mask |= CWY;
+    if (width > 0 && (!known || p[2] != width))
+        mask |= CWWidth;
+    if (height > 0 && (!known || p[3] != height))
+        mask |= CWHeight;
+
+    if (!mask)
+        return;
+
+    XConfigureWindow(display, w, mask, &wc);
+    p[0] = x;
+    p[1] = y;
+    if (width > 0)
+        p[2] = width;
+    if (height > 0)
+        p[3] = height;
 }
 
 Bool
@@ -148,10 +444,24 @@ IsClientFocusable(Client *c)
 {
     return c
         && c->monitor == activeMonitor
-        && c->desktop == c->monitor->activeDesktop
+        && IsClientOnDesktop(c, c->monitor->activeDesktop)
         && c->types & NetWMTypeFocusable;
 }
 
+Bool
+IsClientOnDesktop(Client *c, int desktop)
+{
+    /* stickies are a layer of their monitor, above its desktops */
+    return c->desktop == desktop || c->states & NetWMStateSticky;
+}
+
+int
+GetShownDesktop(Client *c)
+{
+    /* stickies follow the active desktop, and its work area */
+    return c->states & NetWMStateSticky ? c->monitor->activeDesktop : c->desktop;
+}
+
 void
 FocusClient(Client *c, Bool b)
 {
@@ -181,38 +491,240 @@ FocusClient(Client *c, Bool b)
                 XUngrabButton(display, Button1, Mod| modifiers[i], c->window);
     }
 
-    RefreshClient(c);
+    InvalidateClient(c);
 }
 
 void
 RefreshClient(Client *c)
 {
-    Visual *v;
-    cairo_surface_t *surface;  
-    cairo_t *cairo; 
+    int x, y, w, h;
+    int state = GetButtonState(c, -1);
 
-    /* do not attempt to refresh non decorated or hidden clients */
-    if ((!c->isTopbarVisible && !c->isBorderVisible)
-            || (c->desktop != c->monitor->activeDesktop
-                && !(c->states & NetWMStateSticky)))
+    /* do not attempt to refresh hidden clients */
+    if (!IsClientOnDesktop(c, c->monitor->activeDesktop))
         return;
 
-    v = DefaultVisual(display, DefaultScreen(display));
-    surface = cairo_xlib_surface_create(display, c->frame, v, c->fw, c->fh);
-    cairo = cairo_create(surface);
-    cairo_set_line_cap(cairo, CAIRO_LINE_CAP_ROUND);
+    EnterProbe(&refreshClientProbe);
 
-    DrawFrame(c, cairo);
+    /* the client covers the frame but its topbar, what it does not
+     * paint yet shows the background color. The border is the frame
+     * window one, the topbar has its own background pixmap. The
+     * server repaints exposures by itself and painting costs the
+     * perimeter, not the area */
+    XSetWindowBackground(display, c->frame,
+            GetPixel(GetStateBackground(state)));
+    if (c->isBorderVisible)
+        XSetWindowBorder(display, c->frame, GetPixel(GetBorderColor(c)));
+    XClearWindow(display, c->frame);
 
     if (c->hasTopbar && c->isTopbarVisible) {
-        WriteTitle(c, cairo);
-        for (int i = 0; i < ButtonCount; ++i) {
-            DrawButton(c, cairo, i);
+        GetTopbarGeometry(c, &x, &y, &w, &h);
+        if (w > 0 && h > 0) {
+            /* the pixmap only grows, by steps, so that resizing does
+             * not allocate one per motion. Only its left part shows */
+            if (c->background == None || c->backgroundWidth < w) {
+                if (c->background != None)
+                    XFreePixmap(display, c->background);
+                c->backgroundWidth = (w + BackgroundStep - 1)
+                    / BackgroundStep * BackgroundStep;
+                c->background = XCreatePixmap(display, c->topbar,
+                        c->backgroundWidth, h,
+                        DefaultDepth(display, DefaultScreen(display)));
+            }
+
+            XFillRectangle(display, c->background, backgroundGCs[state],
+                    0, 0, w, h);
+            WriteTitle(c);
+
+            for (int i = 0; buttonAtlas != None && i < ButtonCount; ++i) {
+                GetButtonGeometry(c, i, &x, &y, &w, &h);
+                XCopyArea(display, buttonAtlas, c->background, decorationGC,
+                        i * w, GetButtonState(c, i) * h, w, h, x, y);
+            }
+
+            XSetWindowBackgroundPixmap(display, c->topbar, c->background);
+            XClearWindow(display, c->topbar);
         }
     }
 
-    cairo_destroy(cairo);
-    cairo_surface_destroy(surface);
+    LeaveProbe(&refreshClientProbe);
+}
+
+void
+ReleaseClientDecorations(Client *c)
+{
+    if (c->background != None) {
+        XFreePixmap(display, c->background);
+        c->background = None;
+    }
+
+    free(c->titleText);
+    c->titleText = NULL;
+
+    if (c->titlePixmap != None) {
+        XFreePixmap(display, c->titlePixmap);
+        c->titlePixmap = None;
+    }
+}
+
+void
+InvalidateClient(Client *c)
+{
+    if (c->isDirty)
+        return;
+
+    c->isDirty = True;
+    c->dnext = dirtyClients;
+    dirtyClients = c;
+}
+
+void
+CancelClientRefresh(Client *c)
+{
+    Client **tc;
+
+    CancelTimer(&c->nameTimer);
+    DiscardClientProperties(c);
+
+    if (!c->isDirty)
+        return;
+
+    for (tc = &dirtyClients; *tc && *tc != c; tc = &(*tc)->dnext);
+    if (*tc)
+        *tc = c->dnext;
+    c->dnext = NULL;
+    c->isDirty = False;
+}
+
+void
+RefreshDirtyClients()
+{
+    while (dirtyClients) {
+        Client *c = dirtyClients;
+        dirtyClients = c->dnext;
+        c->dnext = NULL;
+        c->isDirty = False;
+        RefreshClient(c);
+    }
+}
+
+void
+UpdateClientName(Client *c)
+{
+    long elapsed;
+
+    /* hidden clients fetch their name when shown again */
+    if (!c->isVisible) {
+        c->stale |= StaleName;
+        return;
+    }
+
+    /* a trailing update is already pending */
+    if (c->nameTimer.isScheduled)
+        return;
+
+    elapsed = (Timestamp() - c->nameTime) / 1000;
+    if (elapsed >= settings.titleInterval) {
+        c->stale |= StaleName;
+        RequestStaleProperties(c);
+    } else {
+        c->nameTimer.f = OnNameTimer;
+        c->nameTimer.data = c;
+        ScheduleTimer(&c->nameTimer, settings.titleInterval - elapsed);
+    }
+}
+
+void
+UpdateClientHints(Client *c)
+{
+    /* hidden clients fetch their hints when shown again */
+    c->stale |= StaleHints;
+    if (c->isVisible)
+        RequestStaleProperties(c);
+}
+
+void
+RequestStaleProperties(Client *c)
+{
+    /* what is already requested is received first */
+    int missing = c->stale & ~c->fetching;
+
+    if (!missing)
+        return;
+
+    if (missing & StaleName) {
+        RequestWMName(c->window, &c->netNameCookie, &c->nameCookie);
+        c->nameTime = Timestamp();
+    }
+    if (missing & StaleHints)
+        c->hintsCookie = RequestWMHints(c->window);
+
+    if (!c->fetching)
+        fetchingCount++;
+    c->fetching |= missing;
+    c->stale &= ~missing;
+}
+
+void
+ReceiveStaleProperties()
+{
+    /* once per batch, after the layout synced the replies are
+     * already there and none of this waits */
+    if (!fetchingCount)
+        return;
+
+    for (Client *c = clients; c; c = c->next)
+        if (c->fetching)
+            ReceiveClientProperties(c);
+}
+
+void
+ReceiveClientProperties(Client *c)
+{
+    if (c->fetching & StaleName) {
+        ReceiveWMName(c->netNameCookie, c->nameCookie, &c->name);
+        InvalidateClient(c);
+    }
+
+    if (c->fetching & StaleHints) {
+        ReceiveWMHints(c->hintsCookie, &c->hints);
+        if (c->hints & HintsUrgent)
+            InvalidateClient(c);
+    }
+
+    c->fetching = 0;
+    fetchingCount--;
+
+    /* changed again meanwhile */
+    if (c->stale && c->isVisible)
+        RequestStaleProperties(c);
+}
+
+void
+DiscardClientProperties(Client *c)
+{
+    if (!c->fetching)
+        return;
+
+    if (c->fetching & StaleName) {
+        xcb_discard_reply(connection, c->netNameCookie.sequence);
+        xcb_discard_reply(connection, c->nameCookie.sequence);
+    }
+    if (c->fetching & StaleHints)
+        xcb_discard_reply(connection, c->hintsCookie.sequence);
+
+    c->fetching = 0;
+    fetchingCount--;
+}
+
+void
+OnNameTimer(void *data)
+{
+    Client *c = data;
+
+    c->stale |= StaleName;
+    if (c->isVisible)
+        RequestStaleProperties(c);
 }
 
 void
@@ -412,7 +924,7 @@ void
 MaximizeClientHorizontally(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximizedHorz;
         MoveResizeClientFrame(c, d->wx, c->fy, d->ww, c->fh, False);
@@ -424,7 +936,7 @@ void
 MaximizeClientVertically(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximizedVert;
         MoveResizeClientFrame(c, c->fx, d->wy, c->fw, d->wh, False);
@@ -436,7 +948,7 @@ void
 MaximizeClient(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximized;
         MoveResizeClientFrame(c, d->wx, d->wy, d->ww, d->wh, False);
@@ -448,7 +960,7 @@ void
 MaximizeClientLeft(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximizedVert;
         c->states &= ~NetWMStateMaximizedHorz;
@@ -461,7 +973,7 @@ void
 MaximizeClientRight(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximizedVert;
         c->states &= ~NetWMStateMaximizedHorz;
@@ -475,7 +987,7 @@ void
 MaximizeClientTop(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximizedHorz;
         c->states &= ~NetWMStateMaximizedVert;
@@ -488,7 +1000,7 @@ void
 MaximizeClientBottom(Client *c)
 {
     if (!(c->types & NetWMTypeFixed) && !IsFixed(c->normals) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         SaveGeometries(c);
         c->states |= NetWMStateMaximizedHorz;
         c->states &= ~NetWMStateMaximizedVert;
@@ -516,7 +1028,7 @@ SnapClientLeft(Client *c)
 {
     if (!(c->states & (NetWMStateMaximized | NetWMStateFullscreen))
             && !(c->types & NetWMTypeFixed) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         MoveClientFrame(c, d->wx, c->fy);
     }
 }
@@ -526,7 +1038,7 @@ SnapClientRight(Client *c)
 {
     if (!(c->states & (NetWMStateMaximized | NetWMStateFullscreen))
             && !(c->types & NetWMTypeFixed) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         MoveClientFrame(c, d->wx + d->ww - c->fw, c->fy);
     }
 }
@@ -536,7 +1048,7 @@ SnapClientTop(Client *c)
 {
     if (!(c->states & (NetWMStateMaximized | NetWMStateFullscreen))
             && !(c->types & NetWMTypeFixed) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         MoveClientFrame(c, c->fx, d->wy);
     }
 }
@@ -546,7 +1058,7 @@ SnapClientBottom(Client *c)
 {
     if (!(c->states & (NetWMStateMaximized | NetWMStateFullscreen))
             && !(c->types & NetWMTypeFixed) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         MoveClientFrame(c, c->fx, d->wy + d->wh - c->fh);
     }
 }
@@ -556,7 +1068,7 @@ CenterClient(Client *c)
 {
     if (!(c->states & (NetWMStateMaximized | NetWMStateFullscreen))
             && !(c->types & NetWMTypeFixed) && !c->isTiled) {
-        Desktop *d = &c->monitor->desktops[c->desktop];
+        Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
         MoveClientFrame(c, d->wx + (d->ww - c->fw) / 2,
                 d->wy + (d->wh - c->fh) / 2);
     }
@@ -605,6 +1117,7 @@ RaiseClient(Client *c)
 {
     c->states |= NetWMStateAbove;
     c->states &= ~NetWMStateBelow;
+    c->stackOrder = ++stackCount;
     XRaiseWindow(display, c->frame);
     if (c->hasHandles)
         for (int i = 0; i < HandleCount; ++i)
@@ -621,6 +1134,7 @@ LowerClient(Client *c)
 {
     c->states |= NetWMStateBelow;
     c->states &= ~NetWMStateAbove;
+    c->stackOrder = -(++stackCount);
     XLowerWindow(display, c->frame);
     if (c->hasHandles)
         for (int i = 0; i < HandleCount; ++i)
@@ -636,67 +1150,52 @@ void
 MoveClientToDesktop(Client *c, int desktop)
 {
     int from = c->desktop;
-    Monitor *m = c->monitor;
-    Desktop *d = &(m->desktops[desktop]);
 
     if (desktop < 0 || desktop >= DesktopCount || c->desktop == desktop)
         return;
 
-    /* remove ourself from previous desktop if any */
-    if (c->desktop >= 0) {
-        Desktop *pd = &m->desktops[c->desktop];
-        if (c->strut.right
-                || c->strut.left
-                || c->strut.top
-                || c->strut.bottom) {
-            pd->wx = m->x;
-            pd->wy = m->y;
-            pd->ww = m->w;
-            pd->wh = m->h;
-            for (Client *mc = m->head; mc; mc = mc->next) {
-                if (mc != c && mc->desktop == c->desktop) {
-                    pd->wx = Max(pd->wx, m->x + mc->strut.left);
-                    pd->wy = Max(pd->wy, m->y + mc->strut.top);
-                    pd->ww = Min(pd->ww, m->w -
-                            (mc->strut.right + mc->strut.left));
-                    pd->wh = Min(pd->wh, m->h -
-                            (mc->strut.top + mc->strut.bottom));
-                }
-            }
-        }
-    }
+    AssignClientDesktop(c, desktop);
 
-    /* now set the new one */
-    if (c->strut.right || c->strut.left || c->strut.top || c->strut.bottom) {
-        d->wx = Max(d->wx, m->x + c->strut.left);
-        d->wy = Max(d->wy, m->y + c->strut.top);
-        d->ww = Min(d->ww, m->w - (c->strut.right + c->strut.left));
-        d->wh = Min(d->wh, m->h - (c->strut.top + c->strut.bottom));
+    if (from != -1) { /* it's probably a new window not affected yet */
+        SetFocusedClient(NULL);
+        RefreshMonitor(c->monitor);
     }
+}
+
+void
+AssignClientDesktop(Client *c, int desktop)
+{
+    Monitor *m = c->monitor;
+    Desktop *d = &(m->desktops[desktop]);
+    int from = c->desktop;
+    long nd;
 
     c->isTopbarVisible = d->showTopbars;
     c->desktop = desktop;
 
+    /* the struts of stickies reserve their space on every desktop */
+    if (c->strut.right || c->strut.left || c->strut.top || c->strut.bottom)
+        for (int i = 0; i < DesktopCount; ++i)
+            if (i == from || i == desktop || c->states & NetWMStateSticky)
+                UpdateDesktopWorkArea(m, i);
+
     if (c->isTiled && !d->isDynamic) {
         UntileClient(c);
         //RefreshMonitor(c->monitor);
     }
 
-    if (!(c->types & NetWMTypeFixed))
-        MoveResizeClientFrame(c,
-                Max(c->fx, c->monitor->desktops[c->desktop].wx),
-                Max(c->fy, c->monitor->desktops[c->desktop].wy),
-                Min(c->fw, c->monitor->desktops[c->desktop].ww),
-                Min(c->fh, c->monitor->desktops[c->desktop].wh), False);
-
-    if (from != -1) { /* it's probably a new window not affected yet */
-        SetFocusedClient(NULL);
-        RefreshMonitor(m);
+    /* kept in the work area it is shown in */
+    if (!(c->types & NetWMTypeFixed)) {
+        Desktop *sd = &m->desktops[GetShownDesktop(c)];
+        MoveResizeClientFrame(c, Max(c->fx, sd->wx), Max(c->fy, sd->wy),
+                Min(c->fw, sd->ww), Min(c->fh, sd->wh), False);
     }
 
-    /* finally let the pager know where we are */
+    /* finally let the pager know where we are, stickies are on all
+     * desktops */
+    nd = c->states & NetWMStateSticky ? (long)0xFFFFFFFF : c->desktop;
     XChangeProperty(display, c->window, atoms[AtomNetWMDesktop],
-            XA_CARDINAL, 32, PropModeReplace, (unsigned char*)&c->desktop, 1);
+            XA_CARDINAL, 32, PropModeReplace, (unsigned char*)&nd, 1);
 }
 
 void
@@ -715,8 +1214,9 @@ void
 MoveClientToMonitor(Client *c, Monitor *m)
 {
     int x, y;
-    x = c->fx - c->monitor->desktops[c->desktop].wx + m->desktops[m->activeDesktop].wx;
-    y = c->fy - c->monitor->desktops[c->desktop].wy + m->desktops[m->activeDesktop].wy;
+    Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
+    x = c->fx - d->wx + m->desktops[m->activeDesktop].wx;
+    y = c->fy - d->wy + m->desktops[m->activeDesktop].wy;
     DetachClientFromMonitor(c->monitor, c);
     AttachClientToMonitor(m, c);
     MoveClientFrame(c, x, y);
@@ -782,8 +1282,9 @@ void
 GetTopbarGeometry(Client *c, int *x, int *y, int *w, int *h)
 {
     int bw = c->isBorderVisible ? settings.borderWidth : 0;
-    *x = bw;
-    *y = bw;
+    /* inside the frame border */
+    *x = 0;
+    *y = 0;
     *w = c->fw - 2 * bw;
     *h = settings.topbarHeight;
 }
@@ -811,110 +1312,530 @@ SetSourceColor(cairo_t *cairo, int color)
 }
 
 void
-WriteTitle(Client *c, cairo_t *cairo)
+WriteTitle(Client *c)
+{
+    int bw = c->isBorderVisible ? settings.borderWidth : 0;
+    int bs = ButtonCount * (settings.buttonSize + settings.buttonGap);
+    int w = c->fw - 2 * bw - 2 * bs;
+    int h = settings.topbarHeight;
+    int state = GetButtonState(c, -1);    /* never hovered */
+    int n = GetTitleLength(c->name);
+
+    /* the title is centered, leaving room for the buttons on both sides */
+    if (w <= 0 || h <= 0)
+        return;
+
+    /* only rendered again when the name, the width or the colors
+     * changed, the previous title is shown until it is done */
+    if (!c->titleText || (int)strlen(c->titleText) != n
+            || strncmp(c->titleText, c->name, n)
+            || c->titleWidth != w || c->titleState != state) {
+        free(c->titleText);
+        c->titleText = strndup(c->name, n);
+        c->titleWidth = w;
+        c->titleState = state;
+        RequestTitle(c, w, h, state);
+    }
+
+    if (c->titlePixmap != None)
+        XCopyArea(display, c->titlePixmap, c->background, decorationGC,
+                0, 0, Min(w, c->titlePixmapWidth), h, bs, 0);
+}
+
+void
+RequestTitle(Client *c, int w, int h, int state)
 {
-    int fg, bw, x, y, w, h;
-    PangoLayout *layout;
-    PangoFontDescription *desc;
+    TitleJob *j, **it;
+
+    pthread_mutex_lock(&titleLock);
+
+    /* a title not started yet is only updated */
+    for (it = &pendingTitles; *it && (*it)->window != c->window;
+            it = &(*it)->next);
+    j = *it;
+    if (!j) {
+        j = calloc(1, sizeof(TitleJob));
+        if (!j) {
+            pthread_mutex_unlock(&titleLock);
+            ELog("can't allocate title");
+            return;
+        }
+        j->window = c->window;
+        *it = j;
+    }
 
-    /* select the frame colors */
-    if (c->states & NetWMStateDemandsAttention || c->hints & HintsUrgent) {
-        fg = settings.urgentForeground;
-    }  else if (c->isFocused) {
-        fg = settings.activeForeground;
+    j->serial = c->titleSerial = ++titleSerial;
+    strncpy(j->text, c->titleText, TitleMaxLength);
+    j->w = w;
+    j->h = h;
+    if (state == ButtonStateUrgent) {
+        j->fg = settings.urgentForeground;
+        j->bg = settings.urgentBackground;
+    } else if (state == ButtonStateActive) {
+        j->fg = settings.activeForeground;
+        j->bg = settings.activeBackground;
     } else {
-        fg = settings.inactiveForeground;
+        j->fg = settings.inactiveForeground;
+        j->bg = settings.inactiveBackground;
     }
-        
-    /* what is the border width */
-    bw = c->isBorderVisible ? settings.borderWidth : 0;
 
-    /* label */
-    layout = pango_cairo_create_layout(cairo);
-    pango_layout_set_text(layout, c->name, -1);
-    desc = pango_font_description_from_string(settings.labelFontname);
-    pango_layout_set_font_description(layout, desc);
-    pango_font_description_free(desc);
-
-    pango_layout_get_size(layout, &w, &h);
-    x = (c->fw - (double)w/PANGO_SCALE) / 2.0;
-    y = bw + (settings.topbarHeight - (double)h/PANGO_SCALE) / 2.0;
-    cairo_move_to(cairo, x, y);
-    SetSourceColor(cairo, fg);
+    /* without workers the title is rendered right away */
+    if (!titleWorkerCount) {
+        *it = NULL;
+        pthread_mutex_unlock(&titleLock);
+        RenderTitle(j, titleLayout);
+        CompleteTitle(j);
+        return;
+    }
+
+    pthread_cond_signal(&titleCondition);
+    pthread_mutex_unlock(&titleLock);
+}
+
+void
+RenderTitle(TitleJob *j, PangoLayout *layout)
+{
+    int tw, th;
+    cairo_t *cairo;
+
+    pango_layout_set_text(layout, j->text, -1);
+    pango_layout_set_width(layout, j->w * PANGO_SCALE);
+    pango_layout_get_pixel_size(layout, &tw, &th);
+
+    j->image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, j->w, j->h);
+    cairo = cairo_create(j->image);
+    SetSourceColor(cairo, j->bg);
+    cairo_paint(cairo);
+    SetSourceColor(cairo, j->fg);
+    cairo_move_to(cairo, (j->w - tw) / 2.0, (j->h - th) / 2.0);
     pango_cairo_show_layout(cairo, layout);
+    cairo_destroy(cairo);
+    cairo_surface_flush(j->image);
+}
+
+Client *
+CompleteTitle(TitleJob *j)
+{
+    Client *c = LookupClient(j->window);
+
+    /* the client is gone or asked for another title since */
+    if (!c || c->titleSerial != j->serial
+            || cairo_surface_status(j->image) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(j->image);
+        free(j);
+        return NULL;
+    }
+
+    /* the raster is kept server side as long as it is valid */
+    if (c->titlePixmap != None && c->titlePixmapWidth != j->w) {
+        XFreePixmap(display, c->titlePixmap);
+        c->titlePixmap = None;
+    }
+    if (c->titlePixmap == None)
+        c->titlePixmap = XCreatePixmap(display, c->frame, j->w, j->h,
+                DefaultDepth(display, DefaultScreen(display)));
+    c->titlePixmapWidth = j->w;
+
+    UploadImage(j->image, c->titlePixmap, j->w, j->h);
+    cairo_surface_destroy(j->image);
+    free(j);
+    return c;
+}
+
+void
+ReceiveTitles()
+{
+    char buffer[64];
+    TitleJob *j, *finished = NULL;
+
+    while (read(titlePipe[0], buffer, sizeof(buffer)) > 0);
+
+    /* finished titles are pushed in front, complete them in order */
+    j = atomic_exchange(&finishedTitles, NULL);
+    while (j) {
+        TitleJob *next = j->next;
+        j->next = finished;
+        finished = j;
+        j = next;
+    }
+
+    while (finished) {
+        Client *c;
+        j = finished;
+        finished = finished->next;
+        if ((c = CompleteTitle(j)))
+            InvalidateClient(c);
+    }
+}
+
+void *
+RunTitleWorker(void *arg)
+{
+    /* pango is not thread safe, each worker shapes with its own
+     * context from its own thread default font map */
+    PangoContext *context = CreateFontContext();
+    PangoLayout *layout = CreateTitleLayout(context);
+    (void)arg;
+
+    for (;;) {
+        TitleJob *j;
+
+        pthread_mutex_lock(&titleLock);
+        while (!pendingTitles && !stopTitleWorkers)
+            pthread_cond_wait(&titleCondition, &titleLock);
+        if (stopTitleWorkers) {
+            pthread_mutex_unlock(&titleLock);
+            break;
+        }
+        j = pendingTitles;
+        pendingTitles = j->next;
+        pthread_mutex_unlock(&titleLock);
+
+        RenderTitle(j, layout);
+
+        j->next = atomic_load(&finishedTitles);
+        while (!atomic_compare_exchange_weak(&finishedTitles, &j->next, j));
+        while (write(titlePipe[1], "", 1) < 0 && errno == EINTR);
+    }
+
     g_object_unref(layout);
+    g_object_unref(context);
+    return NULL;
+}
+
+PangoLayout *
+CreateTitleLayout(PangoContext *context)
+{
+    PangoLayout *layout = pango_layout_new(context);
+    pango_layout_set_font_description(layout, labelFont);
+    pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
+    pango_layout_set_single_paragraph_mode(layout, True);
+    return layout;
 }
 
 void
-DrawFrame(Client *c, cairo_t *cairo)
+SetupTitleWorkers()
 {
-    int bg, bc, bw;
-    /* select the frame colors */
-    if (c->states & NetWMStateDemandsAttention || c->hints & HintsUrgent) {
-        bg = settings.urgentBackground;
-        bc = settings.urgentBorder;
-    }  else if (c->isFocused) {
-        bg = settings.activeBackground;
-        bc = c->isTiled ? settings.activeTileBackground
-                : settings.activeBorder;
-    } else {
-        bg = settings.inactiveBackground;
-        bc = c->isTiled ? settings.inactiveTileBackground
-                : settings.inactiveBorder;
+    titleLayout = CreateTitleLayout(pangoContext);
+    stopTitleWorkers = False;
+
+    if (pipe(titlePipe) < 0) {
+        ELog("can't create title pipe: %s", strerror(errno));
+        titlePipe[0] = titlePipe[1] = -1;
+        return;
     }
 
-    /* what is the border width */
-    bw = c->isBorderVisible ? settings.borderWidth : 0;
+    for (int i = 0; i < 2; ++i) {
+        fcntl(titlePipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(titlePipe[i], F_SETFL, O_NONBLOCK);
+    }
 
-    /* background */
-    SetSourceColor(cairo, bg);
-    cairo_rectangle(cairo, bw, bw, c->fw - 2 * bw, c->fh - 2 * bw);  
-    cairo_fill(cairo);
+    for (titleWorkerCount = 0; titleWorkerCount < TitleWorkerCount;
+            ++titleWorkerCount)
+        if (pthread_create(&titleWorkers[titleWorkerCount], NULL,
+                    RunTitleWorker, NULL)) {
+            ELog("can't start title worker");
+            break;
+        }
 
-    /* border */
-    if (c->isBorderVisible) {
-        cairo_set_line_width(cairo, 2 * bw);
-        SetSourceColor(cairo, bc);
-        cairo_rectangle(cairo, 0, 0, c->fw, c->fh);  
-        cairo_stroke(cairo);
+    WatchDescriptor(titlePipe[0], ReceiveTitles);
+}
+
+void
+CleanupTitleWorkers()
+{
+    TitleJob *j;
+
+    pthread_mutex_lock(&titleLock);
+    stopTitleWorkers = True;
+    pthread_cond_broadcast(&titleCondition);
+    pthread_mutex_unlock(&titleLock);
+
+    for (int i = 0; i < titleWorkerCount; ++i)
+        pthread_join(titleWorkers[i], NULL);
+    titleWorkerCount = 0;
+
+    while ((j = pendingTitles)) {
+        pendingTitles = j->next;
+        free(j);
+    }
+
+    j = atomic_exchange(&finishedTitles, NULL);
+    while (j) {
+        TitleJob *next = j->next;
+        cairo_surface_destroy(j->image);
+        free(j);
+        j = next;
+    }
+
+    WatchDescriptor(-1, NULL);
+    for (int i = 0; i < 2; ++i) {
+        if (titlePipe[i] >= 0)
+            close(titlePipe[i]);
+        titlePipe[i] = -1;
+    }
+
+    if (titleLayout)
+        g_object_unref(titleLayout);
+    titleLayout = NULL;
+}
+
+void
+UploadImage(cairo_surface_t *image, Drawable d, int w, int h)
+{
+    cairo_surface_t *surface;
+    cairo_t *cairo;
+
+    cairo_surface_flush(image);
+    if (UploadShmImage(image, d, w, h)) {
+        RecordUpload(UploadShm);
+        return;
+    }
+
+    RecordUpload(UploadXlib);
+    surface = cairo_xlib_surface_create(display, d,
+            DefaultVisual(display, DefaultScreen(display)), w, h);
+    cairo = cairo_create(surface);
+    cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cairo, image, 0, 0);
+    cairo_paint(cairo);
+    cairo_destroy(cairo);
+    cairo_surface_flush(surface);
+    cairo_surface_destroy(surface);
+}
+
+Bool
+UploadShmImage(cairo_surface_t *image, Drawable d, int w, int h)
+{
+    XImage *xi;
+    unsigned char *data = cairo_image_surface_get_data(image);
+    int stride = cairo_image_surface_get_stride(image);
+    size_t size;
+
+    if (!hasShm || !data)
+        return False;
+
+    /* the arena is full until the server is done with it */
+    size = (size_t)w * h * 4;
+    if (shmUsed + size > ShmArenaSize)
+        return False;
+
+    xi = XShmCreateImage(display, DefaultVisual(display, DefaultScreen(display)),
+            DefaultDepth(display, DefaultScreen(display)), ZPixmap,
+            shmSegment.shmaddr + shmUsed, &shmSegment, w, h);
+    if (!xi)
+        return False;
+
+    if (xi->bits_per_pixel != 32 || (size_t)xi->bytes_per_line * h > size) {
+        XDestroyImage(xi);
+        return False;
+    }
+
+    for (int y = 0; y < h; ++y)
+        memcpy(xi->data + y * xi->bytes_per_line, data + y * stride, w * 4);
+
+    /* the completion event tells when the pixels may be overwritten */
+    XShmPutImage(display, d, decorationGC, xi, 0, 0, 0, 0, w, h, True);
+    XDestroyImage(xi);
+    shmUsed += size;
+    shmPending++;
+    return True;
+}
+
+void
+ReleaseUpload(XShmCompletionEvent *e)
+{
+    /* completions of a previous segment do not count */
+    if (!hasShm || e->shmseg != shmSegment.shmseg || shmPending <= 0)
+        return;
+
+    if (!--shmPending)
+        shmUsed = 0;
+}
+
+void
+ReleaseFailedUpload()
+{
+    /* a put the server refused never completes */
+    if (!hasShm || shmPending <= 0)
+        return;
+
+    if (!--shmPending)
+        shmUsed = 0;
+}
+
+void
+SetupShm()
+{
+    Visual *v = DefaultVisual(display, DefaultScreen(display));
+    int depth = DefaultDepth(display, DefaultScreen(display));
+    int one = 1;
+    XErrorHandler handler;
+
+    /* cairo images are native endian xRGB words copied as they are,
+     * the server must expect exactly that */
+    if (!(extensions & ExtentionShm) || (depth != 24 && depth != 32)
+            || v->red_mask != 0xFF0000 || v->green_mask != 0xFF00
+            || v->blue_mask != 0xFF
+            || ImageByteOrder(display) != (*(char *)&one ? LSBFirst : MSBFirst))
+        return;
+
+    shmSegment.shmid = shmget(IPC_PRIVATE, ShmArenaSize, IPC_CREAT | 0600);
+    if (shmSegment.shmid < 0)
+        return;
+
+    shmSegment.shmaddr = shmat(shmSegment.shmid, NULL, 0);
+    if (shmSegment.shmaddr == (char *)-1) {
+        shmctl(shmSegment.shmid, IPC_RMID, NULL);
+        return;
+    }
+    shmSegment.readOnly = True;
+
+    /* a remote server accepts the extension but can not attach, this
+     * is only known once the request is processed */
+    shmFailed = False;
+    handler = XSetErrorHandler(ShmErrorHandler);
+    XShmAttach(display, &shmSegment);
+    SyncDisplay(False);
+    XSetErrorHandler(handler);
+
+    /* the segment goes away with its last user */
+    shmctl(shmSegment.shmid, IPC_RMID, NULL);
+
+    if (shmFailed) {
+        ILog("shared memory uploads unavailable");
+        shmdt(shmSegment.shmaddr);
+        return;
     }
+
+    hasShm = True;
+    shmUsed = 0;
+    shmPending = 0;
 }
 
 void
-DrawButton(Client *c, cairo_t *cairo, int button)
+CleanupShm()
+{
+    if (!hasShm)
+        return;
+
+    XShmDetach(display, &shmSegment);
+    SyncDisplay(False);
+    shmdt(shmSegment.shmaddr);
+    hasShm = False;
+}
+
+int
+ShmErrorHandler(Display *d, XErrorEvent *e)
+{
+    (void)d;
+    (void)e;
+    shmFailed = True;
+    return 0;
+}
+
+int
+GetTitleLength(const char *name)
+{
+    int n = strnlen(name, TitleMaxLength + 1);
+
+    /* do not cut an utf-8 sequence */
+    if (n > TitleMaxLength) {
+        n = TitleMaxLength;
+        while (n > 0 && (name[n] & 0xC0) == 0x80)
+            n--;
+    }
+    return n;
+}
+
+int
+GetBorderColor(Client *c)
+{
+    if (c->states & NetWMStateDemandsAttention || c->hints & HintsUrgent)
+        return settings.urgentBorder;
+
+    if (c->isFocused)
+        return c->isTiled ? settings.activeTileBackground
+                : settings.activeBorder;
+
+    return c->isTiled ? settings.inactiveTileBackground
+            : settings.inactiveBorder;
+}
+
+int
+GetStateBackground(int state)
+{
+    switch (state) {
+        case ButtonStateUrgent:
+            return settings.urgentBackground;
+        case ButtonStateActive:
+        case ButtonStateActiveHovered:
+            return settings.activeBackground;
+        default:
+            return settings.inactiveBackground;
+    }
+}
+
+unsigned long
+GetPixel(int color)
+{
+    /* true color visuals only, the channels are scaled to the masks */
+    Visual *v = DefaultVisual(display, DefaultScreen(display));
+    unsigned long masks[3] = { v->red_mask, v->green_mask, v->blue_mask };
+    unsigned long pixel = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        unsigned long value = (color >> (16 - 8 * i)) & 0xFF;
+        int shift = 0, bits = 0;
+
+        if (!masks[i])
+            continue;
+        while (!((masks[i] >> shift) & 1))
+            shift++;
+        while (shift + bits < (int)(8 * sizeof(long))
+                && ((masks[i] >> (shift + bits)) & 1))
+            bits++;
+
+        value = bits < 8 ? value >> (8 - bits) : value << (bits - 8);
+        pixel |= value << shift;
+    }
+
+    return pixel;
+}
+
+void
+DrawButton(cairo_t *cairo, int button, int state, int x, int y, int w, int h)
 {
     int bbg, bfg, bbc;
-    int x, y, w, h;
 
     /* select the button colors */
-    if (c->states & NetWMStateDemandsAttention || c->hints & HintsUrgent) {
-        bbg = settings.urgentBackground;
-        bfg = settings.urgentForeground;
-        bbc = settings.urgentForeground;
-    }  else if (c->isFocused) {
-        if (button == c->hovered) {
+    switch (state) {
+        case ButtonStateUrgent:
+            bbg = settings.urgentBackground;
+            bfg = settings.urgentForeground;
+            bbc = settings.urgentForeground;
+        break;
+        case ButtonStateActiveHovered:
             bbg = settings.buttonStyles[button].activeHoveredBackground;
             bfg = settings.buttonStyles[button].activeHoveredForeground;
             bbc = settings.buttonStyles[button].inactiveHoveredBorder;
-        } else {
+        break;
+        case ButtonStateActive:
             bbg = settings.buttonStyles[button].activeBackground;
             bfg = settings.buttonStyles[button].activeForeground;
             bbc = settings.buttonStyles[button].activeBorder;
-        }
-    } else {
-        if (button == c->hovered) {
+        break;
+        case ButtonStateInactiveHovered:
             bbg = settings.buttonStyles[button].inactiveHoveredBackground;
             bfg = settings.buttonStyles[button].inactiveHoveredForeground;
             bbc = settings.buttonStyles[button].inactiveHoveredBorder;
-        } else {
+        break;
+        default:
             bbg = settings.buttonStyles[button].inactiveBackground;
             bfg = settings.buttonStyles[button].inactiveForeground;
             bbc = settings.buttonStyles[button].inactiveBorder;
-        }
+        break;
     }
-    
-    /* draw buttons */
-    GetButtonGeometry(c, button, &x, &y, &w, &h);
 
     if (settings.buttonShape == ButtonRound) {
         /* button background */
@@ -942,26 +1863,17 @@ DrawButton(Client *c, cairo_t *cairo, int button)
 
     /* button icon */
     SetSourceColor(cairo, bfg);
-    if (strlen(settings.buttonStyles[button].icon)) {
+    if (iconLayouts[button]) {
         int tw, th;
         double dx, dy, dw, dh;
-        PangoLayout *layout;
-        PangoFontDescription *desc;
 
-        layout = pango_cairo_create_layout(cairo);
-        pango_layout_set_text(layout, settings.buttonStyles[button].icon, -1);
-        desc = pango_font_description_from_string(settings.iconFontname);
-        pango_layout_set_font_description(layout, desc);
-        pango_font_description_free(desc);
-
-        pango_layout_get_size(layout, &tw, &th);
+        pango_layout_get_size(iconLayouts[button], &tw, &th);
         dw = (double)tw/PANGO_SCALE;
         dh = (double)th/PANGO_SCALE;
         dx = (double)x + ((double)w - dw) / 2.0;
         dy = (double)y + ((double)h - dh) / 2.0;
         cairo_move_to(cairo, dx, dy);
-        pango_cairo_show_layout(cairo, layout);
-        g_object_unref(layout);
+        pango_cairo_show_layout(cairo, iconLayouts[button]);
     } else {
         cairo_set_line_width (cairo, 1.5);
         if (button == ButtonClose) {
@@ -994,3 +1906,59 @@ DrawButton(Client *c, cairo_t *cairo, int button)
         }
     }
 }
+
+PangoContext *
+CreateFontContext()
+{
+    PangoContext *context = pango_font_map_create_context(
+            pango_cairo_font_map_get_default());
+    pango_cairo_context_set_font_options(context, fontOptions);
+    pango_cairo_context_set_resolution(context, fontResolution);
+    return context;
+}
+
+int
+GetButtonState(Client *c, int button)
+{
+    if (c->states & NetWMStateDemandsAttention || c->hints & HintsUrgent)
+        return ButtonStateUrgent;
+
+    if (c->isFocused)
+        return button == c->hovered
+            ? ButtonStateActiveHovered : ButtonStateActive;
+
+    return button == c->hovered
+        ? ButtonStateInactiveHovered : ButtonStateInactive;
+}
+
+void
+CreateButtonAtlas()
+{
+    cairo_surface_t *surface;
+    cairo_t *cairo;
+    int bs = settings.buttonSize;
+    int w = bs * ButtonCount;
+    int h = bs * ButtonStateCount;
+
+    if (bs <= 0)
+        return;
+
+    buttonAtlas = XCreatePixmap(display, root, w, h,
+            DefaultDepth(display, DefaultScreen(display)));
+    surface = cairo_xlib_surface_create(display, buttonAtlas,
+            DefaultVisual(display, DefaultScreen(display)), w, h);
+    cairo = cairo_create(surface);
+    cairo_set_line_cap(cairo, CAIRO_LINE_CAP_ROUND);
+
+    for (int s = 0; s < ButtonStateCount; ++s) {
+        SetSourceColor(cairo, GetStateBackground(s));
+        cairo_rectangle(cairo, 0, s * bs, w, bs);
+        cairo_fill(cairo);
+        for (int b = 0; b < ButtonCount; ++b)
+            DrawButton(cairo, b, s, b * bs, s * bs, bs, bs);
+    }
+
+    cairo_destroy(cairo);
+    cairo_surface_flush(surface);
+    cairo_surface_destroy(surface);
+}
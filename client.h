@@ -2,11 +2,17 @@
 #define __CLIENT_H__
 
 #include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <cairo/cairo.h>
+#include <pango/pangocairo.h>
 
+#include "event.h"
 #include "hints.h"
 
 typedef enum Handles Handles;
 typedef enum Buttons Buttons;
+typedef enum Parts Parts;
+typedef enum StaleProperties StaleProperties;
 typedef enum NetWMActions NetWMActions;
 
 typedef struct Client Client;
@@ -32,6 +38,25 @@ enum Buttons {
     ButtonCount
 };
 
+/* windows making a client, buttons and handles are indexed
+ * from PartButton and PartHandle respectively */
+enum Parts {
+    PartNone,
+    PartWindow,
+    PartFrame,
+    PartTopbar,
+    PartButton,
+    PartHandle = PartButton + ButtonCount,
+    PartCount = PartHandle + HandleCount
+};
+
+/* properties changed while the client was hidden, they are fetched
+ * when it is shown again */
+enum StaleProperties {
+    StaleName = 1 << 0,
+    StaleHints = 1 << 1
+};
+
 struct Transient {
     Client *client;
     Transient *next;
@@ -50,6 +75,11 @@ struct Client {
     int shx, shy, shw, shh; /* saved frame geometry ante minimixed      */
     int stx, sty, stw, sth; /* Saved frame geometry ante tiling         */
     int sbw;                /* Saved border width                       */
+    int frameBorder;        /* border width of the frame window         */
+    unsigned long unmapSerial; /* last request unmapping the window     */
+    int placed[PartCount][4];  /* last geometry sent, by part, x y w h  */
+    int nx, ny, nw, nh;     /* Window geometry the client was told      */
+    long stackOrder;        /* higher is above, see stackCount          */
     Bool hasTopbar;
     Bool hasHandles;
     Bool isBorderVisible;
@@ -57,6 +87,8 @@ struct Client {
     Bool isFocused;
     Bool isTiled;
     Bool isVisible;
+    Bool isMapped;          /* as requested, see UnmapHidden            */
+    Bool isDirty;
     char *name;
     WMClass wmclass;
     WMNormals normals;
@@ -74,17 +106,49 @@ struct Client {
     Client *next;
     Client *snext;
     Client *sprev;
+    Client *dnext;
+    Pixmap background;          /* topbar background pixmap             */
+    int backgroundWidth;        /* at least the topbar's, as high       */
+    char *titleText;            /* name, width and state the title was  */
+    int titleWidth;             /* last requested with                  */
+    int titleState;
+    unsigned long titleSerial;  /* last requested rendering             */
+    Pixmap titlePixmap;         /* last rendered title                  */
+    int titlePixmapWidth;
+    Timer nameTimer;            /* trailing edge of name updates        */
+    long nameTime;              /* last name update, in us              */
+    int stale;                  /* see StaleProperties                  */
+    int fetching;               /* stale properties requested           */
+    xcb_get_property_cookie_t netNameCookie;
+    xcb_get_property_cookie_t nameCookie;
+    xcb_get_property_cookie_t hintsCookie;
 };
 
-extern Client *clients; 
+extern Client *clients;
+extern long stackCount;     /* raises and lowers so far */
+
+void SetupDecorations();
+void CleanupDecorations();
 
 void KillClient(Client *c);
 
 void HideClient(Client *c);
 void ShowClient(Client *c);
 Bool IsClientFocusable(Client *c);
+Bool IsClientOnDesktop(Client *c, int desktop);
+int GetShownDesktop(Client *c);
 void FocusClient(Client *c, Bool b);
 void RefreshClient(Client *c);
+void InvalidateClient(Client *c);
+void CancelClientRefresh(Client *c);
+void RefreshDirtyClients();
+void UpdateClientName(Client *c);
+void UpdateClientHints(Client *c);
+void RequestStaleProperties(Client *c);
+void ReceiveStaleProperties();
+void ReleaseClientDecorations(Client *c);
+void ReleaseUpload(XShmCompletionEvent *e);
+void ReleaseFailedUpload();
 void SetClientTopbarVisible(Client *c, Bool b);
 void ToggleClientTopbar(Client *c);
 
@@ -1,5 +1,11 @@
 #include <X11/X.h>
 #include <X11/Xlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -8,12 +14,14 @@
 #include <X11/Xproto.h>
 #include <X11/Xatom.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/shmproto.h>
 
 #include "client.h"
 #include "event.h"
 #include "hints.h"
 #include "log.h"
 #include "manager.h"
+#include "metrics.h"
 #include "monitor.h"
 #include "settings.h"
 #include "x11.h"
@@ -33,7 +41,6 @@ static void OnConfigureRequest(XConfigureRequestEvent *e);
 static void OnMapRequest(XMapRequestEvent *e);
 static void OnUnmapNotify(XUnmapEvent *e);
 static void OnDestroyNotify(XDestroyWindowEvent *e);
-static void OnExpose(XExposeEvent *e);
 static void OnEnter(XCrossingEvent *e);
 static void OnLeave(XCrossingEvent *e);
 static void OnPropertyNotify(XPropertyEvent *e);
@@ -45,12 +52,19 @@ static void OnKeyPress(XKeyPressedEvent *e);
 static void OnKeyRelease(XKeyReleasedEvent *e);
 static void Snap(int x, int y, int w, int h, int *xp,
         int *yp, int *wp, int *hp, int snap);
+static void SetupSignals();
+static void CleanupSignals();
+static void OnSignal(int sig);
+static void HandleSignals();
+static long Now();
+static int NextTimeout();
+static void RunTimers();
 
 static XErrorHandler defaultErrorHandler = NULL;
 static char *terminal[] = {"xterm", NULL};
+static const char execFailed[] = "ERROR - terminal: exec failed\n";
 static int lastSeenPointerX = -1;
 static int lastSeenPointerY = -1;
-static Time lastSeenPointerTime = 0;
 static Time lastClickPointerTime = 0;
 static int motionStartX = 0;
 static int motionStartY = 0;
@@ -59,77 +73,124 @@ static int motionStartH = 0;
 static int moveMessageType = 0;
 static Bool switching = 0;
 static Bool running = 0;
+static int signalPipe[2] = { -1, -1 };
+static Timer *timers = NULL;
+static int watchedFd = -1;
+static void (*onWatchedFd)() = NULL;
 
 void
 StartEventLoop()
 {
-    int xConnection;
-    fd_set fdSet;
+    struct pollfd fds[3];
 
     defaultErrorHandler = XSetErrorHandler(EnableErrorHandler);
 
+    SetupSignals();
     XSync(display, False);
-    xConnection = XConnectionNumber(display);
+    fds[0].fd = XConnectionNumber(display);
+    fds[0].events = POLLIN;
+    fds[1].fd = signalPipe[0];
+    fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
     running = True;
     while (running) {
-        struct timeval timeout = { 0, 500000 };
-        FD_ZERO(&fdSet);
-        FD_SET(xConnection, &fdSet);
-
-        if (select(xConnection + 1, &fdSet, NULL, NULL, &timeout) > 0) {
-            while (XPending(display)) {
-                XEvent e;
-                XNextEvent(display, &e);
-
-                switch(e.type) {
-                    case MapRequest:
-                        OnMapRequest(&e.xmaprequest);
-                    break;
-                    case UnmapNotify:
-                        OnUnmapNotify(&e.xunmap);
-                    break;
-                    case DestroyNotify:
-                        OnDestroyNotify(&e.xdestroywindow);
-                    break;
-                    case Expose:
-                        OnExpose(&e.xexpose);
-                    break;
-                    case ConfigureRequest:
-                        OnConfigureRequest(&e.xconfigurerequest);
-                    break;
-                    case PropertyNotify:
-                        OnPropertyNotify(&e.xproperty);
-                    break;
-                    case ButtonPress:
-                        OnButtonPress(&e.xbutton);
-                    break;
-                    case ButtonRelease:
-                        OnButtonRelease(&e.xbutton);
-                    break;
-                    case MotionNotify:
-                        OnMotionNotify(&e.xmotion);
-                    break;
-                    case EnterNotify:
-                        OnEnter(&e.xcrossing);
-                    break;
-                    case LeaveNotify:
-                        OnLeave(&e.xcrossing);
-                    break;
-                    case ClientMessage:
-                        OnMessage(&e.xclient);
-                    break;
-                    case KeyPress:
-                        OnKeyPress(&e.xkey);
-                    break;
-                    case KeyRelease:
-                        OnKeyRelease(&e.xkey);
-                    break;
-                }
-
-                XFlush(display);
+#ifndef NDEBUG
+        unsigned long flushes = flushCount;
+        unsigned long syncs = syncCount;
+        int events = 0;
+#endif
+
+        /* drain everything already received, handlers only queue
+         * requests which are sent at once when the batch is over.
+         * XPending would flush on every call, reading without
+         * flushing is what QueuedAfterReading is for */
+        RecordQueueDepth(XEventsQueued(display, QueuedAfterReading));
+        while (XEventsQueued(display, QueuedAfterReading)) {
+            XEvent e;
+            XNextEvent(display, &e);
+#ifndef NDEBUG
+            events++;
+#endif
+
+            BeginEvent();
+
+            switch(e.type) {
+                case MapRequest:
+                    OnMapRequest(&e.xmaprequest);
+                break;
+                case UnmapNotify:
+                    OnUnmapNotify(&e.xunmap);
+                break;
+                case DestroyNotify:
+                    OnDestroyNotify(&e.xdestroywindow);
+                break;
+                case ConfigureRequest:
+                    OnConfigureRequest(&e.xconfigurerequest);
+                break;
+                case PropertyNotify:
+                    OnPropertyNotify(&e.xproperty);
+                break;
+                case ButtonPress:
+                    OnButtonPress(&e.xbutton);
+                break;
+                case ButtonRelease:
+                    OnButtonRelease(&e.xbutton);
+                break;
+                case MotionNotify:
+                    OnMotionNotify(&e.xmotion);
+                break;
+                case EnterNotify:
+                    OnEnter(&e.xcrossing);
+                break;
+                case LeaveNotify:
+                    OnLeave(&e.xcrossing);
+                break;
+                case ClientMessage:
+                    OnMessage(&e.xclient);
+                break;
+                case KeyPress:
+                    OnKeyPress(&e.xkey);
+                break;
+                case KeyRelease:
+                    OnKeyRelease(&e.xkey);
+                break;
+                default:
+                    if (e.type == shmCompletionType)
+                        ReleaseUpload((XShmCompletionEvent *)&e);
+                break;
             }
+            EndEvent(&e);
         }
+
+        RunTimers();
+        RefreshDirtyMonitors();
+        ReceiveStaleProperties();
+        RefreshDirtyClients();
+        PublishClientList();
+        FlushDisplay();
+#ifndef NDEBUG
+        if (events)
+            DLog("batch: %d events, %lu flushes, %lu syncs", events,
+                    flushCount - flushes, syncCount - syncs);
+#endif
+
+        /* sleep until there is something to do, without timer
+         * the only wake ups are X input and signals. Flushing may
+         * have pulled events in, then the other descriptors are only
+         * looked at, a busy X stream does not starve them */
+        fds[0].revents = fds[1].revents = fds[2].revents = 0;
+        fds[2].fd = watchedFd;
+        if (poll(fds, 3, XEventsQueued(display, QueuedAfterReading) ?
+                    0 : NextTimeout()) < 0 && errno != EINTR)
+            ELog("poll failed: %s", strerror(errno));
+
+        if (fds[1].revents & POLLIN)
+            HandleSignals();
+
+        if (fds[2].revents & POLLIN && onWatchedFd)
+            onWatchedFd();
     }
+    CleanupSignals();
 }
 
 void
@@ -138,10 +199,164 @@ StopEventLoop()
     running = False;
 }
 
+void
+WatchDescriptor(int fd, void (*f)())
+{
+    /* a single extra descriptor, negative to stop watching */
+    watchedFd = fd;
+    onWatchedFd = f;
+}
+
+void
+ScheduleTimer(Timer *t, long ms)
+{
+    Timer **it;
+
+    CancelTimer(t);
+    t->deadline = Now() + ms;
+    t->isScheduled = True;
+
+    /* keep the timers sorted by deadline */
+    for (it = &timers; *it && (*it)->deadline <= t->deadline; it = &(*it)->next);
+    t->next = *it;
+    *it = t;
+}
+
+void
+CancelTimer(Timer *t)
+{
+    Timer **it;
+
+    if (!t->isScheduled)
+        return;
+
+    for (it = &timers; *it && *it != t; it = &(*it)->next);
+    if (*it)
+        *it = t->next;
+    t->next = NULL;
+    t->isScheduled = False;
+}
+
+void
+SetupSignals()
+{
+    struct sigaction sa;
+
+    /* signals are turned into bytes on a pipe so they are handled
+     * from the event loop and wake it up */
+    if (pipe(signalPipe) < 0) {
+        ELog("can't create signal pipe: %s", strerror(errno));
+        signalPipe[0] = signalPipe[1] = -1;
+    } else {
+        for (int i = 0; i < 2; ++i) {
+            fcntl(signalPipe[i], F_SETFD, FD_CLOEXEC);
+            fcntl(signalPipe[i], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSignal;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+void
+CleanupSignals()
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+
+    for (int i = 0; i < 2; ++i) {
+        if (signalPipe[i] >= 0)
+            close(signalPipe[i]);
+        signalPipe[i] = -1;
+    }
+}
+
+void
+OnSignal(int sig)
+{
+    int e = errno;
+    unsigned char b = sig;
+
+    if (write(signalPipe[1], &b, 1) < 0) {
+        /* the pipe is full, the loop will wake up anyway */
+    }
+    errno = e;
+}
+
+void
+HandleSignals()
+{
+    unsigned char b[64];
+    ssize_t n;
+
+    while ((n = read(signalPipe[0], b, sizeof(b))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            if (b[i] == SIGCHLD) {
+                /* reap the terminals and autostart children */
+                while (waitpid(-1, NULL, WNOHANG) > 0);
+            } else if (b[i] == SIGUSR1) {
+                DumpMetrics();
+            } else {
+                ILog("signal %d received.", b[i]);
+                StopEventLoop();
+            }
+        }
+    }
+}
+
+long
+Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+NextTimeout()
+{
+    long d;
+
+    if (!timers)
+        return -1;
+
+    d = timers->deadline - Now();
+    return d < 0 ? 0 : d > INT_MAX ? INT_MAX : (int)d;
+}
+
+void
+RunTimers()
+{
+    long now = Now();
+
+    while (timers && timers->deadline <= now) {
+        Timer *t = timers;
+        timers = t->next;
+        t->next = NULL;
+        t->isScheduled = False;
+        t->f(t->data);
+    }
+}
+
 int
 EnableErrorHandler(Display *d, XErrorEvent *e)
 {
     char message[256];
+    /* a failed upload is not completed, its arena space is released */
+    if (e->request_code == shmOpcode && e->minor_code == X_ShmPutImage) {
+        ReleaseFailedUpload();
+        ILog("shared memory upload failed (ignored)");
+        return 0;
+    }
+
     /* ignore some error */
     if (e->error_code == BadWindow
             || (e->request_code == X_SetInputFocus && e->error_code == BadMatch)
@@ -233,6 +448,8 @@ OnConfigureRequest(XConfigureRequestEvent *e)
             if (e->value_mask & CWHeight)
                 h = e->height;
 
+            /* the client waits for an answer even if nothing moves */
+            c->nw = 0;
             MoveResizeClientWindow(c, x, y, w, h, True);
         }
 
@@ -245,7 +462,6 @@ OnConfigureRequest(XConfigureRequestEvent *e)
                 LowerClient(c);
         }
     }
-    XSync(display, False);
 }
 
 void
@@ -253,6 +469,8 @@ OnMapRequest(XMapRequestEvent *e)
 {
     XWindowAttributes wa;
 
+    /* attributes and geometry */
+    roundTripCount += 2;
     if (!XGetWindowAttributes(display, e->window, &wa))
         return;
 
@@ -261,13 +479,40 @@ OnMapRequest(XMapRequestEvent *e)
         return;
     }
 
-    if (!LookupClient(e->window))
+    Client *c = LookupClient(e->window);
+    if (!c) {
         ManageWindow(e->window, False);
+        return;
+    }
+
+    /* a client leaves the iconic state by mapping its window again */
+    if (!c->isMapped) {
+        ShowMonitorDesktop(c->monitor, GetShownDesktop(c));
+        if (c->states & NetWMStateHidden)
+            RestoreClient(c);
+        SetFocusedClient(c);
+    }
 }
 
 void
 OnUnmapNotify(XUnmapEvent *e)
 {
+    Client *c;
+
+    /* clients withdrawing a window we unmapped can only tell it with
+     * a synthetic UnmapNotify */
+    if (e->send_event && e->event == root) {
+        c = LookupClient(e->window);
+        if (c && !c->isMapped) {
+            long state[] = {WithdrawnState, None};
+            XChangeProperty(display, e->window, atoms[AtomWMState],
+                    atoms[AtomWMState], 32, PropModeReplace,
+                    (unsigned char *)state, 2);
+            UnmanageWindow(e->window, False);
+        }
+        return;
+    }
+
     /* ignore UnmapNotify from reparenting  */
     if (e->event != root && e->event != None) {
         if (e->send_event) {
@@ -276,6 +521,10 @@ OnUnmapNotify(XUnmapEvent *e)
                     atoms[AtomWMState], 32, PropModeReplace,
                     (unsigned char *)state, 2);
         } else {
+            /* nor the ones caused by our own requests */
+            c = LookupClient(e->window);
+            if (c && (long)(e->serial - c->unmapSerial) <= 0)
+                return;
             UnmanageWindow(e->window, False);
         }
     }
@@ -287,48 +536,34 @@ OnDestroyNotify(XDestroyWindowEvent *e)
     UnmanageWindow(e->window, True);
 }
 
-void
-OnExpose(XExposeEvent *e)
-{
-    Client *c = LookupClient(e->window);
-    if (c)
-        RefreshClient(c);
-}
-
 void
 OnPropertyNotify(XPropertyEvent *e)
 {
-    Client *c = LookupClient(e->window);
-    if (!c)
-        return;
+    int part;
+    Client *c = LookupClientPart(e->window, &part);
 
-    if (!c || e->window != c->window)
+    if (!c || part != PartWindow)
         return;
 
-    if (e->atom == XA_WM_NAME || e->atom == atoms[AtomNetWMName]) {
-        GetWMName(c->window, &c->name);
-        RefreshClient(c);
-    }
+    if (e->atom == XA_WM_NAME || e->atom == atoms[AtomNetWMName])
+        UpdateClientName(c);
 
-    if (e->atom == XA_WM_HINTS) {
-        GetWMHints(c->window, &c->hints);
-        if (c->hints & HintsUrgent) {
-            RefreshClient(c);
-        }
-    }
+    if (e->atom == XA_WM_HINTS)
+        UpdateClientHints(c);
 }
 
 void
 OnButtonPress(XButtonEvent *e)
 {
     Client *c = NULL;
+    int part;
 
     if (e->window == root) {
         SetFocusedMonitor(MonitorContaining(e->x_root, e->y_root));
         return;
     }
 
-    c = LookupClient(e->window);
+    c = LookupClientPart(e->window, &part);
     if (!c)
         return;
 
@@ -340,8 +575,8 @@ OnButtonPress(XButtonEvent *e)
     motionStartH = c->fh;
 
     if (!c->isTiled) {
-        if (e->window == c->topbar
-                || (e->window == c->window && e->state == Mod)) {
+        if (part == PartTopbar
+                || (part == PartWindow && e->state == Mod)) {
             int delay = e->time - lastClickPointerTime;
             if (delay > 150 && delay < 450) {
                 if ((c->states & NetWMStateMaximized)) {
@@ -354,7 +589,7 @@ OnButtonPress(XButtonEvent *e)
             }
         }
 
-        if (e->window == c->buttons[ButtonMaximize]) {
+        if (part == PartButton + ButtonMaximize) {
             if ((c->states & NetWMStateMaximized)) {
                 RestoreClient(c);
             } else {
@@ -362,19 +597,19 @@ OnButtonPress(XButtonEvent *e)
             }
         }
 
-        if (e->window == c->buttons[ButtonMinimize]) {
+        if (part == PartButton + ButtonMinimize) {
             MinimizeClient(c);
             SetFocusedClient(NULL);
         }
     }
 
-    if (e->window == c->buttons[ButtonClose])
+    if (part == PartButton + ButtonClose)
         KillClient(c);
 
-    if (e->window != c->buttons[ButtonClose] && e->window != c->buttons[ButtonMinimize])
+    if (part != PartButton + ButtonClose && part != PartButton + ButtonMinimize)
         SetFocusedClient(c);
 
-    if (e->window == c->window)
+    if (part == PartWindow)
         XAllowEvents(display, ReplayPointer, CurrentTime);
 
     lastClickPointerTime = e->time;
@@ -383,7 +618,8 @@ OnButtonPress(XButtonEvent *e)
 void
 OnButtonRelease(XButtonEvent *e)
 {
-    Client *c = LookupClient(e->window);
+    int part;
+    Client *c = LookupClientPart(e->window, &part);
     if (!c)
         return;
 
@@ -392,47 +628,49 @@ OnButtonRelease(XButtonEvent *e)
         XUngrabPointer(display, CurrentTime);
     }
 
-    if (!c->isTiled) {
-        for (int i = 0; i < HandleCount; ++i) {
-            if (e->window == c->handles[i]) {
-                /* apply the size hints */
-                MoveResizeClientFrame(c, c->fx, c->fy, c->fw, c->fh, True);
-                break;
-            }
-        }
-    }
+    /* apply the size hints */
+    if (!c->isTiled && part >= PartHandle)
+        MoveResizeClientFrame(c, c->fx, c->fy, c->fw, c->fh, True);
 
-    if (e->window == c->topbar || e->window == c->window) {
+    if (part == PartTopbar || part == PartWindow) {
         XDefineCursor(display, e->window, cursors[CursorNormal]);
         /* TODO: check monitor consistency */
     }
 
-    if (e->window == c->window)
+    if (part == PartWindow)
         XAllowEvents(display, ReplayPointer, CurrentTime);
 }
 
 void
 OnMotionNotify(XMotionEvent *e)
 {
-    Client *c = LookupClient(e->window);
+    int part;
+    XEvent next;
+    Client *c = LookupClientPart(e->window, &part);
 
-    /* prevent moving type fixed, maximized or fulscreen window
-     * avoid to move to often as well */
+    /* prevent moving type fixed, maximized or fulscreen window */
     if (!c || c->types & NetWMTypeFixed
-            || c->states & (NetWMStateMaximized | NetWMStateFullscreen)
-            || (e->time - lastSeenPointerTime) <= 20)
+            || c->states & (NetWMStateMaximized | NetWMStateFullscreen))
         return;
 
+    /* compress motion, only the latest position queued for this
+     * window is worth handling */
+    while (XEventsQueued(display, QueuedAfterReading)) {
+        XPeekEvent(display, &next);
+        if (next.type != MotionNotify || next.xmotion.window != e->window)
+            break;
+        XNextEvent(display, &next);
+        *e = next.xmotion;
+    }
+
     /* update client geometry */
     int vx = e->x_root - lastSeenPointerX;
     int vy = e->y_root - lastSeenPointerY;
 
-    lastSeenPointerTime = e->time;
-
     if (c->isTiled) {
-        if (e->window == c->handles[HandleWest]
-                || e->window == c->handles[HandleEast]) {
-            c->monitor->desktops[c->desktop].split =
+        if (part == PartHandle + HandleWest
+                || part == PartHandle + HandleEast) {
+            c->monitor->desktops[GetShownDesktop(c)].split =
                 (e->x_root - c->monitor->x) / (float)c->monitor->w;
             RefreshMonitor(c->monitor);
         }
@@ -444,56 +682,57 @@ OnMotionNotify(XMotionEvent *e)
         /* we do not apply normal hints during motion but when button is released
          * to make the resizing visually smoother. Some client apply normals by
          * themselves anway (e.g gnome-terminal) */
-        if (e->window == c->topbar || e->window == c->window
+        if (part == PartTopbar || part == PartWindow
                 || moveMessageType == HandleCount) {
 
             x = motionStartX + vx;
             y = motionStartY + vy;
 
             /* border snapping */
-            Desktop *d = &c->monitor->desktops[c->desktop];
+            Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
             Snap(d->wx, d->wy, d->ww, d->wh, &x, &y, &w, &h, settings.snapping);
             for (Client *it = c->monitor->head; it; it = it->snext)
-                if (it != c && it->desktop == c->desktop && it->isVisible)
+                if (it != c && IsClientOnDesktop(it, c->monitor->activeDesktop)
+                        && it->isVisible)
                     Snap(it->fx, it->fy, it->fw, it->fh,
                             &x, &y, &w, &h, settings.snapping);
-        } else if (e->window == c->handles[HandleNorth]
+        } else if (part == PartHandle + HandleNorth
                 || moveMessageType == HandleNorth) {
             x = motionStartX;
             y = motionStartY + vy;
             w = motionStartW;
             h = motionStartH - vy;
-        } else if (e->window == c->handles[HandleWest]
+        } else if (part == PartHandle + HandleWest
                 || moveMessageType == HandleWest) {
             w = motionStartW + vx,
             h = motionStartH;
-        } else if (e->window == c->handles[HandleSouth]
+        } else if (part == PartHandle + HandleSouth
                 || moveMessageType == HandleSouth) {
             w = motionStartW,
             h = motionStartH + vy;
-        } else if (e->window == c->handles[HandleEast]
+        } else if (part == PartHandle + HandleEast
                 || moveMessageType == HandleEast) {
             x = motionStartX + vx;
             y = motionStartY;
             w = motionStartW - vx;
             h = motionStartH;
-        } else if (e->window == c->handles[HandleNorthEast]
+        } else if (part == PartHandle + HandleNorthEast
                 || moveMessageType == HandleNorthEast) {
             x = motionStartX + vx;
             y = motionStartY + vy;
             w = motionStartW - vx;
             h = motionStartH - vy;
-        } else if (e->window == c->handles[HandleNorthWest]
+        } else if (part == PartHandle + HandleNorthWest
                 || moveMessageType == HandleNorthWest) {
             x = motionStartX;
             y = motionStartY + vy;
             w = motionStartW + vx;
             h = motionStartH - vy;
-        } else if (e->window == c->handles[HandleSouthWest]
+        } else if (part == PartHandle + HandleSouthWest
                 || moveMessageType == HandleSouthWest) {
             w = motionStartW + vx,
             h = motionStartH + vy;
-        } else if (e->window == c->handles[HandleSouthEast]
+        } else if (part == PartHandle + HandleSouthEast
                 || moveMessageType == HandleSouthEast) {
             x = motionStartX + vx;
             y = motionStartY;
@@ -555,7 +794,7 @@ OnMessage(XClientMessageEvent *e)
                 else
                     c->states |= NetWMStateDemandsAttention;
             }
-            RefreshClient(c);
+            InvalidateClient(c);
         }
 
         if (e->data.l[1] == (long)atoms[AtomNetWMStateMaximizedHorz]
@@ -634,9 +873,11 @@ OnMessage(XClientMessageEvent *e)
         motionStartW = c->fw;
         motionStartH = c->fh;
         moveMessageType = e->data.l[2];
-        if (moveMessageType <= HandleCount)
+        if (moveMessageType <= HandleCount) {
+            roundTripCount++;
             XGrabPointer(display, c->frame, False, ButtonReleaseMask | PointerMotionMask,
                     GrabModeAsync, GrabModeSync, None, cursors[CursorMove],CurrentTime);
+        }
     }
 }
 
@@ -644,42 +885,36 @@ void
 OnEnter(XCrossingEvent *e)
 {
     Client *c = NULL;
+    int part;
 
     if ((e->mode != NotifyNormal || e->detail == NotifyInferior) && e->window != root)
         return;
 
-    c = LookupClient(e->window);
+    c = LookupClientPart(e->window, &part);
 
     if (c) {
-        if (e->window == c->frame
+        if (part == PartFrame
                 && (settings.focusFollowsPointer
                     ||  c->isTiled
                     || c->monitor != activeMonitor))
             SetFocusedClient(c);
 
-       for (int i = 0; i < ButtonCount; ++i) {
-           if (e->window == c->buttons[i]) {
-                c->hovered = i;
-                RefreshClient(c);
-                break;
-           }
-       }
+        if (part >= PartButton && part < PartHandle) {
+            c->hovered = part - PartButton;
+            InvalidateClient(c);
+        }
     }
 }
 
 void
 OnLeave(XCrossingEvent *e)
 {
-    Client *c = LookupClient(e->window);
+    int part;
+    Client *c = LookupClientPart(e->window, &part);
 
-    if (c) {
-        for (int i = 0; i < ButtonCount; ++i) {
-            if (e->window == c->buttons[i]) {
-                c->hovered = ButtonCount;
-                RefreshClient(c);
-                break;
-            }
-        }
+    if (c && part >= PartButton && part < PartHandle) {
+        c->hovered = ButtonCount;
+        InvalidateClient(c);
     }
 }
 
@@ -700,8 +935,12 @@ OnKeyPress(XKeyPressedEvent *e)
               close(ConnectionNumber(display));
             setsid();
             execvp((char *)terminal[0], (char **)terminal);
-            ELog("%s: failed", terminal[0]);
-            exit(EXIT_SUCCESS);
+            /* the title workers may hold the stdio and malloc locks,
+             * only async signal safe calls are left */
+            if (write(STDERR_FILENO, execFailed, sizeof(execFailed) - 1) < 0) {
+                /* nowhere else to tell */
+            }
+            _exit(EXIT_FAILURE);
         }
     }
 
@@ -713,6 +952,7 @@ OnKeyPress(XKeyPressedEvent *e)
                 || CleanMask(ModShift) == CleanMask(e->state))
             && ! switching) {
         switching = True;
+        roundTripCount++;
         XGrabKeyboard(display, root, True, GrabModeAsync, GrabModeAsync, CurrentTime);
     }
 
@@ -748,7 +988,7 @@ OnKeyRelease(XKeyReleasedEvent *e)
     keysym = XkbKeycodeToKeysym(display, e->keycode, 0, 0);
     if (keysym == (ModSym) && activeClient && switching) {
         StackClientTop(activeMonitor, activeClient);
-        if (activeMonitor->desktops[activeClient->desktop].isDynamic)
+        if (activeMonitor->desktops[GetShownDesktop(activeClient)].isDynamic)
             RefreshMonitor(activeClient->monitor);
         switching = False;
         XUngrabKeyboard(display, CurrentTime);
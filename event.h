@@ -3,9 +3,25 @@
 
 #include <X11/Xlib.h>
 
+typedef struct Timer Timer;
+
+/* deferred work, owned by the caller and only linked in the event
+ * loop while it is scheduled */
+struct Timer {
+    void (*f)(void *data);
+    void *data;
+    long deadline;          /* monotonic time in ms */
+    Bool isScheduled;
+    Timer *next;
+};
+
 void StartEventLoop();
 void StopEventLoop();
 
+void ScheduleTimer(Timer *t, long ms);
+void WatchDescriptor(int fd, void (*f)());
+void CancelTimer(Timer *t);
+
 int WMDetectedErrorHandler(Display *d, XErrorEvent *e);
 int EnableErrorHandler(Display *d, XErrorEvent *e);
 int DisableErrorHandler(Display *d, XErrorEvent *e);
@@ -9,122 +9,241 @@
 #include "log.h"
 #include "x11.h"
 
+/* longest name property fetched, in 32 bits units, titles are
+ * capped way below anyway */
+#define NameLength 256
+
+static xcb_get_property_cookie_t RequestProperty(Window w, Atom property,
+        Atom type, long length);
+static xcb_get_property_reply_t *ReceiveProperty(xcb_get_property_cookie_t k,
+        int format, void **value, int *n);
+static int TrimUTF8(const unsigned char *s, int len);
+
 void
-GetWMName(Window w, char **name)
+RequestWindowProperties(Window w, WindowCookies *k)
+{
+    k->geometry = xcb_get_geometry(connection, w);
+    k->transientFor = RequestProperty(w, XA_WM_TRANSIENT_FOR, XA_WINDOW, 1);
+    k->protocols = RequestProperty(w, atoms[AtomWMProtocols], XA_ATOM, 1024);
+    k->types = RequestProperty(w, atoms[AtomNetWMWindowType], XA_ATOM, 1024);
+    k->hints = RequestProperty(w, XA_WM_HINTS, XA_WM_HINTS, 9);
+    k->states = RequestProperty(w, atoms[AtomNetWMState], XA_ATOM, 1024);
+    k->normals = RequestProperty(w, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18);
+    k->netName = RequestProperty(w, atoms[AtomNetWMName], AnyPropertyType, NameLength);
+    k->name = RequestProperty(w, XA_WM_NAME, AnyPropertyType, NameLength);
+    k->klass = RequestProperty(w, XA_WM_CLASS, XA_STRING, 1024);
+    k->strut = RequestProperty(w, atoms[AtomNetWMStrutpartial], XA_CARDINAL, 12);
+    k->motifs = RequestProperty(w, atoms[AtomMotifWMHints], atoms[AtomMotifWMHints], 5);
+}
+
+void
+DiscardWindowProperties(WindowCookies *k)
+{
+    xcb_get_property_cookie_t *p[] = {
+        &k->transientFor, &k->protocols, &k->types, &k->hints, &k->states,
+        &k->normals, &k->netName, &k->name, &k->klass, &k->strut, &k->motifs
+    };
+
+    xcb_discard_reply(connection, k->geometry.sequence);
+    for (unsigned int i = 0; i < sizeof(p) / sizeof(p[0]); ++i)
+        xcb_discard_reply(connection, p[i]->sequence);
+}
+
+void
+ReceiveWindowGeometry(xcb_get_geometry_cookie_t k, int *x, int *y,
+        unsigned int *w, unsigned int *h, unsigned int *b)
 {
-    if (*name)
-        free(*name);
-    *name = NULL;
+    xcb_generic_error_t *e = NULL;
+    xcb_get_geometry_reply_t *r = WaitForReply(k.sequence, &e);
+
+    *x = *y = 0;
+    *w = *h = 1;
+    *b = 0;
+    if (r) {
+        *x = r->x;
+        *y = r->y;
+        *w = r->width;
+        *h = r->height;
+        *b = r->border_width;
+        free(r);
+    }
+    free(e);
+}
 
+void
+ReceiveTransientFor(xcb_get_property_cookie_t k, Window *t)
+{
+    uint32_t *value;
+    int n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&value, &n);
+
+    *t = None;
+    if (r && n > 0)
+        *t = value[0];
+    free(r);
+}
+
+void
+ReceiveWMName(xcb_get_property_cookie_t netName,
+        xcb_get_property_cookie_t name, char **n)
+{
     XTextProperty p;
+    xcb_generic_error_t *e = NULL;
+    xcb_get_property_reply_t *r, *nr, *lr;
+    int len;
+
+    if (*n)
+        free(*n);
+    *n = NULL;
+
+    nr = WaitForReply(netName.sequence, &e);
+    free(e);
+    e = NULL;
+    lr = WaitForReply(name.sequence, &e);
+    free(e);
+
+    r = (nr && nr->type != None && nr->value_len) ? nr : lr;
+    if (!r || r->type == None || !r->value_len) {
+        free(nr);
+        free(lr);
+        *n = strdup("Error");
+        return;
+    }
 
-    if (!XGetTextProperty(display, w, &p, atoms[AtomNetWMName])
-            || !p.nitems)
-        if (!XGetTextProperty(display, w, &p, XA_WM_NAME) || !p.nitems) {
-            *name = strdup("Error");
-            return;
-        }
+    /* the text conversion functions expect what Xlib would have
+     * returned, a null terminated buffer */
+    len = xcb_get_property_value_length(r);
+    /* the net name is UTF-8, a longer one may be cut in a character */
+    if (r == nr && r->bytes_after)
+        len = TrimUTF8(xcb_get_property_value(r), len);
+    p.value = malloc(len + 1);
+    if (!p.value) {
+        ELog("can't allocate name.");
+        free(nr);
+        free(lr);
+        *n = strdup("Error");
+        return;
+    }
+    memcpy(p.value, xcb_get_property_value(r), len);
+    p.value[len] = '\0';
+    p.encoding = r->type;
+    p.format = r->format;
+    p.nitems = r->format == 8 ? (unsigned long)len : r->value_len;
+    free(nr);
+    free(lr);
 
     if (p.encoding == XA_STRING) {
-        *name = strdup((char*)p.value);
+        *n = strdup((char*)p.value);
     } else {
         char **list = NULL;
-        int n;
-        if (XmbTextPropertyToTextList(display, &p, &list, &n) >= Success
-                && n > 0 && *list) {
-            if (n > 1) {
+        int count;
+        if (XmbTextPropertyToTextList(display, &p, &list, &count) >= Success
+                && count > 0 && *list) {
+            if (count > 1) {
                 XTextProperty p2;
-                if (XmbTextListToTextProperty(display, list, n,
+                if (XmbTextListToTextProperty(display, list, count,
                             XStringStyle, &p2) == Success) {
-                    *name = strdup((char *)p2.value);
+                    *n = strdup((char *)p2.value);
                     XFree(p2.value);
                 }
             } else {
-                *name = strdup((char*)*list);
+                *n = strdup((char*)*list);
             }
             XFreeStringList(list);
         }
     }
-    XFree(p.value);
+    free(p.value);
 
-    if (!*name)
-        *name = strdup("None");
+    if (!*n)
+        *n = strdup("None");
 }
 
 void
-GetWMHints(Window w, WMHints *h)
+ReceiveWMHints(xcb_get_property_cookie_t k, WMHints *h)
 {
+    uint32_t *value;
+    int n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&value, &n);
+
     /* the default is to be focusable */
     *h = HintsFocusable;
-    XWMHints *hints = XGetWMHints(display, w);
-    if (hints) {
+    if (r && n >= 2) {
         /* urgency */
-        if (hints->flags & XUrgencyHint)
+        if (value[0] & XUrgencyHint)
             *h |= HintsUrgent;
 
         /* focusable */
-        if (hints->flags & InputHint && ! hints->input)
+        if (value[0] & InputHint && ! value[1])
             *h &= ~HintsFocusable;
-
-        XFree(hints);
     }
+    free(r);
 }
 
 void
-GetWMProtocols(Window w, WMProtocols *h)
+ReceiveWMProtocols(xcb_get_property_cookie_t k, WMProtocols *h)
 {
-    Atom *protocols;
+    uint32_t *protocols;
     int n;
-    if (XGetWMProtocols(display, w, &protocols, &n)) {
-        for (int i = 0; i < n; ++i) {
-            if (protocols[i] == atoms[AtomWMTakeFocus])
-                *h |= NetWMProtocolTakeFocus;
-            if (protocols[i] == atoms[AtomWMDeleteWindow])
-                *h |= NetWMProtocolDeleteWindow;
-        }
-        XFree(protocols);
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&protocols, &n);
+
+    for (int i = 0; r && i < n; ++i) {
+        if (protocols[i] == atoms[AtomWMTakeFocus])
+            *h |= NetWMProtocolTakeFocus;
+        if (protocols[i] == atoms[AtomWMDeleteWindow])
+            *h |= NetWMProtocolDeleteWindow;
     }
+    free(r);
 }
 
 void
-GetWMNormals(Window w, WMNormals *h)
+ReceiveWMNormals(xcb_get_property_cookie_t k, WMNormals *h)
 {
-    XSizeHints hints;
+    int32_t *hints;
     long supplied;
+    int n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&hints, &n);
 
     h->bw = h->bh = h->incw = h->inch = 0;
     h->minw = h->minh = 0;
     h->maxw = h->maxh = INT_MAX;
     h->mina = h->maxa = 0.0;
 
-    if (XGetWMNormalHints(display, w, &hints, &supplied)) {
+    /* pre ICCCM hints are 15 items long without base size nor gravity */
+    if (r && n >= 15) {
+        supplied = hints[0];
+        if (n < 18)
+            supplied &= ~(PBaseSize|PWinGravity);
+
         if (supplied & PBaseSize) {
-            h->bw = hints.base_width;
-            h->bh = hints.base_height;
+            h->bw = hints[15];
+            h->bh = hints[16];
         }
         if (supplied & PResizeInc) {
-            h->incw = hints.width_inc;
-            h->inch = hints.height_inc;
+            h->incw = hints[9];
+            h->inch = hints[10];
         }
-        if (supplied & PMinSize && hints.min_width && hints.min_height) {
-            h->minw = hints.min_width;
-            h->minh = hints.min_height;
+        if (supplied & PMinSize && hints[5] && hints[6]) {
+            h->minw = hints[5];
+            h->minh = hints[6];
         }
-        if (supplied & PMaxSize && hints.max_width && hints.max_height ) {
-            h->maxw = hints.max_width;
-            h->maxh = hints.max_height;
+        if (supplied & PMaxSize && hints[7] && hints[8]) {
+            h->maxw = hints[7];
+            h->maxh = hints[8];
         }
-        if (supplied & PAspect && hints.min_aspect.y && hints.min_aspect.x) {
-            h->mina = (float)hints.min_aspect.y / (float)hints.min_aspect.x;
-            h->maxa = (float)hints.max_aspect.x / (float)hints.max_aspect.y;
+        if (supplied & PAspect && hints[12] && hints[11]) {
+            h->mina = (float)hints[12] / (float)hints[11];
+            h->maxa = (float)hints[13] / (float)hints[14];
         }
     }
+    free(r);
 }
 
 void
-GetWMClass(Window w, WMClass *klass)
+ReceiveWMClass(xcb_get_property_cookie_t k, WMClass *klass)
 {
-    XClassHint hints;
+    char *value;
+    int n, l;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 8, (void **)&value, &n);
 
     if (klass->cname)
         free(klass->cname);
@@ -134,53 +253,44 @@ GetWMClass(Window w, WMClass *klass)
         free(klass->iname);
     klass->iname = NULL;
 
-    if (XGetClassHint(display, w, &hints)) {
-        klass->cname = strdup(hints.res_class);
-        klass->iname = strdup(hints.res_name);
-        XFree(hints.res_class);
-        XFree(hints.res_name);
+    /* instance and class names are null separated */
+    if (r && n > 0) {
+        l = strnlen(value, n);
+        klass->iname = strndup(value, l);
+        if (l + 1 < n)
+            klass->cname = strndup(value + l + 1, n - l - 1);
+        else
+            klass->cname = strdup("");
     }
+    free(r);
 }
 
 void
-GetWMStrut(Window w, WMStrut *strut)
+ReceiveWMStrut(xcb_get_property_cookie_t k, WMStrut *strut)
 {
-    Atom type;
-    int format, status;
-    unsigned long num_items, bytes_after;
-    Atom *prop;
+    uint32_t *prop;
+    int n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&prop, &n);
 
-    prop = NULL;
     strut->left = strut->right = strut->top = strut->bottom = 0;
-    status = XGetWindowProperty(display, w, atoms[AtomNetWMStrutpartial],
-            0, 12, False, XA_CARDINAL, &type, &format, &num_items,
-            &bytes_after, (unsigned char**)&prop);
-
-    if ((status == Success) && prop) {
+    if (r && n >= 4) {
         strut->left = prop[0];
         strut->right = prop[1];
         strut->top = prop[2];
         strut->bottom = prop[3];
-        XFree(prop);
     }
+    free(r);
 }
 
 void
-GetNetWMWindowType(Window w, NetWMWindowType *h)
+ReceiveNetWMWindowType(xcb_get_property_cookie_t k, NetWMWindowType *h)
 {
-    Atom type;
-    int format;
-    unsigned long i, num_items, bytes_after;
-    Atom *wtypes;
-
-    wtypes = NULL;
-
-    XGetWindowProperty(display, w, atoms[AtomNetWMWindowType], 0, 1024,
-            False, XA_ATOM, &type, &format, &num_items, &bytes_after,
-            (unsigned char**)&wtypes);
+    uint32_t *wtypes;
+    int i, n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&wtypes, &n);
 
     *h = 0;
-    for (i = 0; i < num_items; ++i) {
+    for (i = 0; r && i < n; ++i) {
         if (wtypes[i] == atoms[AtomNetWMWindowTypeNormal])
             *h |= NetWMTypeNormal;
         if (wtypes[i] == atoms[AtomNetWMWindowTypeDialog])
@@ -206,28 +316,21 @@ GetNetWMWindowType(Window w, NetWMWindowType *h)
         if (wtypes[i] == atoms[AtomNetWMWindowTypeTooltip])
             *h |= NetWMTypeTooltip;
     }
-    XFree(wtypes);
+    free(r);
     if (!*h)
         *h |= NetWMTypeNormal;
 }
 
 void
-GetNetWMStates(Window w, NetWMStates *h)
+ReceiveNetWMStates(xcb_get_property_cookie_t k, NetWMStates *h)
 {
-    Atom type;
-    int format;
-    unsigned long i, num_items, bytes_after;
-    Atom *states;
-
-    states = NULL;
-
-    XGetWindowProperty(display, w, atoms[AtomNetWMState], 0, 1024,
-            False, XA_ATOM, &type, &format, &num_items, &bytes_after,
-            (unsigned char**)&states);
+    uint32_t *states;
+    int i, n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&states, &n);
 
     *h = NetWMStateNone;
 
-    for(i = 0; i < num_items; ++i) {
+    for(i = 0; r && i < n; ++i) {
         if (states[i] == atoms[AtomNetWMStateModal])
             *h |= NetWMStateModal;
         if (states[i] == atoms[AtomNetWMStateSticky])
@@ -255,7 +358,89 @@ GetNetWMStates(Window w, NetWMStates *h)
         if (states[i] == atoms[AtomNetWMStateDemandsAttention])
             *h |= NetWMStateDemandsAttention;
     }
-    XFree(states);
+    free(r);
+}
+
+void
+ReceiveMotifHints(xcb_get_property_cookie_t k, MotifHints *h)
+{
+    uint32_t *prop;
+    int n;
+    xcb_get_property_reply_t *r = ReceiveProperty(k, 32, (void **)&prop, &n);
+
+    memset(h, 0, sizeof(MotifHints));
+    if (r && n > 4) {
+        h->flags = prop[0];
+        h->functions = prop[1];
+        h->decorations = prop[2];
+        h->input_mode = prop[3];
+        h->state = prop[4];
+    }
+    free(r);
+}
+
+void
+GetWMName(Window w, char **name)
+{
+    xcb_get_property_cookie_t netName, wmName;
+    RequestWMName(w, &netName, &wmName);
+    ReceiveWMName(netName, wmName, name);
+}
+
+void
+GetWMHints(Window w, WMHints *h)
+{
+    ReceiveWMHints(RequestWMHints(w), h);
+}
+
+void
+RequestWMName(Window w, xcb_get_property_cookie_t *netName,
+        xcb_get_property_cookie_t *name)
+{
+    *netName = RequestProperty(w, atoms[AtomNetWMName], AnyPropertyType, NameLength);
+    *name = RequestProperty(w, XA_WM_NAME, AnyPropertyType, NameLength);
+}
+
+xcb_get_property_cookie_t
+RequestWMHints(Window w)
+{
+    return RequestProperty(w, XA_WM_HINTS, XA_WM_HINTS, 9);
+}
+
+void
+GetWMProtocols(Window w, WMProtocols *h)
+{
+    ReceiveWMProtocols(RequestProperty(w, atoms[AtomWMProtocols], XA_ATOM, 1024), h);
+}
+
+void
+GetWMNormals(Window w, WMNormals *h)
+{
+    ReceiveWMNormals(RequestProperty(w, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18), h);
+}
+
+void
+GetWMClass(Window w, WMClass *klass)
+{
+    ReceiveWMClass(RequestProperty(w, XA_WM_CLASS, XA_STRING, 1024), klass);
+}
+
+void
+GetWMStrut(Window w, WMStrut *strut)
+{
+    ReceiveWMStrut(RequestProperty(w, atoms[AtomNetWMStrutpartial], XA_CARDINAL, 12), strut);
+}
+
+void
+GetNetWMWindowType(Window w, NetWMWindowType *h)
+{
+    ReceiveNetWMWindowType(RequestProperty(w, atoms[AtomNetWMWindowType], XA_ATOM, 1024), h);
+}
+
+void
+GetNetWMStates(Window w, NetWMStates *h)
+{
+    ReceiveNetWMStates(RequestProperty(w, atoms[AtomNetWMState], XA_ATOM, 1024), h);
 }
 
 void
@@ -324,6 +509,7 @@ SetNetWMStates(Window w, NetWMStates h)
 
     /* get the current state atoms */
     cstates = NULL;
+    roundTripCount++;
     XGetWindowProperty(display, w, atoms[AtomNetWMState], 0, 1024,
             False, XA_ATOM, &type, &format, &num_items, &bytes_after,
             (unsigned char**)&cstates);
@@ -393,25 +579,8 @@ SetNetWMStates(Window w, NetWMStates h)
 void
 GetMotifHints(Window w, MotifHints *h)
 {
-    Atom type;
-    int format, status;
-    unsigned long num_items, bytes_after;
-    Atom *prop;
-
-    memset(h, 0, sizeof(MotifHints));
-    prop = NULL;
-    status = XGetWindowProperty(display, w, atoms[AtomMotifWMHints], 0, 5,
-            False, atoms[AtomMotifWMHints], &type, &format, &num_items, &bytes_after,
-            (unsigned char**)&prop);
-
-    if ((status == Success) && prop && num_items > 4) {
-        h->flags = prop[0];
-        h->functions = prop[1];
-        h->decorations = prop[2];
-        h->input_mode = prop[3];
-        h->state = prop[4];
-        XFree(prop);
-    }
+    ReceiveMotifHints(RequestProperty(w, atoms[AtomMotifWMHints],
+                atoms[AtomMotifWMHints], 5), h);
 }
 
 void
@@ -429,3 +598,49 @@ SendMessage(Window w, Atom a)
     XSendEvent(display, w, False, NoEventMask, &e);
 }
 
+xcb_get_property_cookie_t
+RequestProperty(Window w, Atom property, Atom type, long length)
+{
+    return xcb_get_property(connection, False, w, property, type, 0, length);
+}
+
+int
+TrimUTF8(const unsigned char *s, int len)
+{
+    int i = len, need;
+
+    /* back to the lead byte of the last sequence */
+    while (i > 0 && (s[i - 1] & 0xC0) == 0x80)
+        i--;
+    if (i == 0)
+        return len;
+
+    need = s[i - 1] < 0x80 ? 1 : s[i - 1] >= 0xF0 ? 4
+        : s[i - 1] >= 0xE0 ? 3 : 2;
+
+    /* drop it when it is not complete */
+    return len - (i - 1) < need ? i - 1 : len;
+}
+
+xcb_get_property_reply_t *
+ReceiveProperty(xcb_get_property_cookie_t k, int format, void **value, int *n)
+{
+    xcb_generic_error_t *e = NULL;
+    xcb_get_property_reply_t *r = WaitForReply(k.sequence, &e);
+
+    *value = NULL;
+    *n = 0;
+    free(e);
+
+    /* missing, mistyped or malformed properties are ignored */
+    if (r && (r->type == None || r->format != format)) {
+        free(r);
+        r = NULL;
+    }
+
+    if (r) {
+        *value = xcb_get_property_value(r);
+        *n = r->value_len;
+    }
+    return r;
+}
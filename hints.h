@@ -2,6 +2,7 @@
 #define __HINTS_H__
 
 #include <X11/Xlib.h>
+#include <xcb/xcb.h>
 
 #define IsFixed(n) (\
         n.minw != 0 &&\
@@ -21,6 +22,7 @@ typedef struct WMClass WMClass;
 typedef struct WMNormals WMNormals;
 typedef struct WMStrut WMStrut;
 typedef struct MotifHints MotifHints;
+typedef struct WindowCookies WindowCookies;
 
 enum WMHints{
     HintsFocusable              = (1<<0),
@@ -160,6 +162,42 @@ struct MotifHints {
     long state;
 };
 
+/* pending requests about a window, sent all at once so the
+ * replies are waited for in a single round trip */
+struct WindowCookies {
+    xcb_get_geometry_cookie_t geometry;
+    xcb_get_property_cookie_t transientFor;
+    xcb_get_property_cookie_t protocols;
+    xcb_get_property_cookie_t types;
+    xcb_get_property_cookie_t hints;
+    xcb_get_property_cookie_t states;
+    xcb_get_property_cookie_t normals;
+    xcb_get_property_cookie_t netName;
+    xcb_get_property_cookie_t name;
+    xcb_get_property_cookie_t klass;
+    xcb_get_property_cookie_t strut;
+    xcb_get_property_cookie_t motifs;
+};
+
+void RequestWindowProperties(Window w, WindowCookies *k);
+void DiscardWindowProperties(WindowCookies *k);
+void ReceiveWindowGeometry(xcb_get_geometry_cookie_t k, int *x, int *y,
+        unsigned int *w, unsigned int *h, unsigned int *b);
+void ReceiveTransientFor(xcb_get_property_cookie_t k, Window *t);
+void ReceiveWMName(xcb_get_property_cookie_t netName,
+        xcb_get_property_cookie_t name, char **n);
+void ReceiveWMHints(xcb_get_property_cookie_t k, WMHints *h);
+void ReceiveWMProtocols(xcb_get_property_cookie_t k, WMProtocols *h);
+void ReceiveWMNormals(xcb_get_property_cookie_t k, WMNormals *h);
+void ReceiveWMClass(xcb_get_property_cookie_t k, WMClass *klass);
+void ReceiveWMStrut(xcb_get_property_cookie_t k, WMStrut *strut);
+void ReceiveNetWMWindowType(xcb_get_property_cookie_t k, NetWMWindowType *h);
+void ReceiveNetWMStates(xcb_get_property_cookie_t k, NetWMStates *h);
+void ReceiveMotifHints(xcb_get_property_cookie_t k, MotifHints *h);
+
+void RequestWMName(Window w, xcb_get_property_cookie_t *netName,
+        xcb_get_property_cookie_t *name);
+xcb_get_property_cookie_t RequestWMHints(Window w);
 void GetWMName(Window w, char **name);
 void GetWMHints(Window w, WMHints *h);
 void GetWMProtocols(Window w, WMProtocols *h);
@@ -1,7 +1,5 @@
 #include <locale.h>
-#include <signal.h>
 #include <stdlib.h>
-#include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -10,6 +8,7 @@
 #include <X11/cursorfont.h>
 #include <X11/extensions/Xrandr.h>
 
+#include "client.h"
 #include "event.h"
 #include "log.h"
 #include "manager.h"
@@ -21,15 +20,6 @@
     #define VERSION "0.0.0"
 #endif
 
-static void TrapSignal(int sig);
-
-void
-TrapSignal(int sig)
-{
-    (void)sig;
-    StopEventLoop();
-}
-
 int
 main(int argc, char **argv)
 {
@@ -55,17 +45,15 @@ main(int argc, char **argv)
     if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
         ELog("no locale support");
 
-    signal(SIGINT, TrapSignal);
-    signal(SIGKILL, TrapSignal);
-    signal(SIGTERM, TrapSignal);
-
     LoadConfigFile();
 
     SetupX11();
     SetupMonitors();
+    SetupDecorations();
     SetupWindowManager();
     StartEventLoop();
     CleanupWindowManager();
+    CleanupDecorations();
     CleanupMonitors();
     CleanupX11();
 
@@ -15,6 +15,7 @@
 #include "log.h"
 #include "macros.h"
 #include "manager.h"
+#include "metrics.h"
 #include "monitor.h"
 #include "settings.h"
 #include "x11.h"
@@ -25,8 +26,7 @@
         | SubstructureNotifyMask)
 
 #define FrameEvenMask (\
-          ExposureMask\
-        | PropertyChangeMask\
+          PropertyChangeMask\
         | ButtonPressMask\
         | EnterWindowMask\
         | SubstructureRedirectMask\
@@ -46,10 +46,38 @@
         | EnterWindowMask\
         | LeaveWindowMask)
 
+/* initial number of registry slots, must be a power of two */
+#define RegistryMinSize 256
+
+typedef struct Registration Registration;
+
+struct Registration {
+    Window window;
+    Client *client;
+    int part;
+};
+
+static Client *AdoptWindow(Window w, WindowCookies *k, Bool mapped,
+        int px, int py);
 static void AttachClient(Client *c);
 static void DetachClient(Client *c);
+static void RegisterClient(Client *c);
+static void UnregisterClient(Client *c);
+static void RegisterWindow(Window w, Client *c, int part);
+static void UnregisterWindow(Window w);
+static Bool GrowRegistry();
 
 static Window supportingWindow;
+static Registration *registry = NULL;
+static unsigned long registrySize = 0;
+static unsigned long registryCount = 0;
+static Window *clientList = NULL;
+static unsigned long clientListSize = 0;
+static unsigned long clientListCount = 0;
+static Bool isClientListDirty = False;
+static Probe manageWindowProbe = { .name = "ManageWindow" };
+static Probe unmanageWindowProbe = { .name = "UnmanageWindow" };
+static Probe setFocusedClientProbe = { .name = "SetFocusedClient" };
 static Client *lastActiveClient = NULL;
 
 Monitor *activeMonitor = NULL;
@@ -122,34 +150,49 @@ SetupWindowManager()
     /* Reset the client list. */
     XDeleteProperty(display, root, atoms[AtomNetClientList]);
 
-    /* manage exiting windows */
+    /* manage exiting windows, the requests about all of them are sent
+     * before waiting for the first reply */
+    roundTripCount += 2;
     XQueryPointer(display, root, &rwin, &cwin, &rx, &ry, &wx, &wy, &mask);
-
-    /* to avoid unmap generated by reparenting to destroy the newly created client */
     if (XQueryTree(display, root, &w0, &w1, &wins, &nwins)) {
+        xcb_get_window_attributes_cookie_t *ak = malloc(nwins * sizeof(*ak));
+        WindowCookies *wk = malloc(nwins * sizeof(WindowCookies));
+
+        if (nwins && (!ak || !wk)) {
+            ELog("can't allocate adoption requests.");
+            nwins = 0;
+        }
+
         for (unsigned int i = 0; i < nwins; ++i) {
-            XWindowAttributes xwa;
-
-            if (wins[i] == supportingWindow)
-                continue;
-
-            XGetWindowAttributes(display, wins[i], &xwa);
-            if (!xwa.override_redirect) {
-                ManageWindow(wins[i], True);
-                /* reparenting does not set the e->event to root
-                 * we discar events to prevent the unmap to be catched
-                 * and wrongly interpreted */
-                XSync(display, True);
-                XSetInputFocus(display, wins[i], RevertToPointerRoot,
-                        CurrentTime);
-                XChangeProperty(display, root, atoms[AtomNetClientList],
-                        XA_WINDOW, 32, PropModeAppend,
-                        (unsigned char *) &wins[i], 1);
-            }
+            ak[i] = xcb_get_window_attributes(connection, wins[i]);
+            RequestWindowProperties(wins[i], &wk[i]);
         }
+
+        for (unsigned int i = 0; i < nwins; ++i) {
+            xcb_generic_error_t *e = NULL;
+            xcb_get_window_attributes_reply_t *a =
+                WaitForReply(ak[i].sequence, &e);
+
+            if (a && !a->override_redirect && wins[i] != supportingWindow)
+                AdoptWindow(wins[i], &wk[i], True, rx, ry);
+            else
+                DiscardWindowProperties(&wk[i]);
+
+            free(a);
+            free(e);
+        }
+
+        free(ak);
+        free(wk);
         XFree(wins);
     }
 
+    /* tile, focus and publish once everything is adopted */
+    for (Monitor *m = monitors; m; m = m->next)
+        RefreshMonitor(m);
+    SetFocusedClient(NULL);
+    PublishClientList();
+
     /* grab shortcuts */
     XUngrabKey(display, AnyKey, AnyModifier, root);
     for (int i = 0; i < ShortcutCount; ++i) {
@@ -170,8 +213,21 @@ CleanupWindowManager()
 {
     /* teardown */
     Client *c, *d;
-    for (c = clients, d = c ? c->next : 0; c; c = d, d = c ? c->next : 0)
+    for (c = clients, d = c ? c->next : 0; c; c = d, d = c ? c->next : 0) {
+        /* do not leave hidden windows unmapped behind */
+        if (!c->isMapped)
+            XMapWindow(display, c->window);
         UnmanageWindow(c->window, False);
+    }
+    PublishClientList();
+
+    free(registry);
+    registry = NULL;
+    registrySize = registryCount = 0;
+
+    free(clientList);
+    clientList = NULL;
+    clientListSize = clientListCount = 0;
 
     XDestroyWindow(display, supportingWindow);
     XSetInputFocus(display, PointerRoot, RevertToPointerRoot, CurrentTime);
@@ -181,34 +237,69 @@ CleanupWindowManager()
 
 void
 ManageWindow(Window w, Bool mapped)
+{
+    WindowCookies k;
+    Window rr, cr;
+    int px = 0, py = 0, wx, wy;
+    unsigned int mr;
+    Client *c;
+
+    EnterProbe(&manageWindowProbe);
+
+    /* get info about the window, all the requests are sent before
+     * waiting for the first reply */
+    RequestWindowProperties(w, &k);
+    if (settings.placement == StrategyPointer) {
+        roundTripCount++;
+        XQueryPointer(display, root, &rr, &cr, &px, &py, &wx, &wy, &mr);
+    }
+
+    c = AdoptWindow(w, &k, mapped, px, py);
+    if (!c) {
+        LeaveProbe(&manageWindowProbe);
+        return;
+    }
+
+    if (c->hints & HintsFocusable && !(c->types & NetWMTypeFixed))
+        SetFocusedClient(c);
+
+    /* if dynamic we need to refresh the tiling */
+    if (c->monitor->desktops[GetShownDesktop(c)].isDynamic)
+        RefreshMonitor(c->monitor);
+
+    LeaveProbe(&manageWindowProbe);
+}
+
+Client *
+AdoptWindow(Window w, WindowCookies *k, Bool mapped, int px, int py)
 {
     DLog("%ld mapped: %d", w, mapped);
-    Window r = None, t = None;
+    Window t = None;
     int wx = 0, wy = 0 ;
-    unsigned int ww, wh, d, b;
+    unsigned int ww, wh, b;
     Bool decorated;
 
     Client *c = malloc(sizeof(Client));
     if (!c) {
         ELog("can't allocate client.");
-        return;
+        DiscardWindowProperties(k);
+        return NULL;
     }
     memset(c, 0, sizeof(Client));
 
     XAddToSaveSet(display, w);
 
-    /* get info about the window */
-    XGetGeometry(display, w, &r, &wx, &wy, &ww, &wh, &b, &d);
-    XGetTransientForHint(display, w, &t);
-    GetWMProtocols(w, &c->protocols);
-    GetNetWMWindowType(w, &c->types);
-    GetWMHints(w, &c->hints);
-    GetNetWMStates(w, &c->states);
-    GetWMNormals(w, &c->normals);
-    GetWMName(w, &c->name);
-    GetWMClass(w, &c->wmclass);
-    GetWMStrut(w, &c->strut);
-    GetMotifHints(w, &c->motifs);
+    ReceiveWindowGeometry(k->geometry, &wx, &wy, &ww, &wh, &b);
+    ReceiveTransientFor(k->transientFor, &t);
+    ReceiveWMProtocols(k->protocols, &c->protocols);
+    ReceiveNetWMWindowType(k->types, &c->types);
+    ReceiveWMHints(k->hints, &c->hints);
+    ReceiveNetWMStates(k->states, &c->states);
+    ReceiveWMNormals(k->normals, &c->normals);
+    ReceiveWMName(k->netName, k->name, &c->name);
+    ReceiveWMClass(k->klass, &c->wmclass);
+    ReceiveWMStrut(k->strut, &c->strut);
+    ReceiveMotifHints(k->motifs, &c->motifs);
 
     Desktop *dp = &activeMonitor->desktops[activeMonitor->activeDesktop];
     c->ww = Min(dp->ww, (int)ww);
@@ -226,6 +317,7 @@ ManageWindow(Window w, Bool mapped)
     c->isFocused = False;
     c->isTiled = False;
     c->isVisible = False;
+    c->isMapped = True;     /* mapped below */
     c->hovered = ButtonCount;
     c->desktop = -1;
 
@@ -254,13 +346,15 @@ ManageWindow(Window w, Bool mapped)
     /* we always frame the window */
     XSetWindowAttributes fattrs = {0};
     fattrs.event_mask = FrameEvenMask;
-    fattrs.backing_store = WhenMapped;
     c->frame = XCreateWindow(display, root, 0, 0, 1, 1, 0,
             CopyFromParent, InputOutput, CopyFromParent,
-            CWEventMask | CWBackingStore, &fattrs);
+            CWEventMask, &fattrs);
 
     /* client */
     c->window = w;
+    /* reparenting a mapped window unmaps it, remember the request
+     * so the resulting UnmapNotify is not taken as a withdrawal */
+    c->unmapSerial = NextRequest(display);
     XReparentWindow(display, w, c->frame, 0, 0);
     XSetWindowBorderWidth(display, w, 0);
     XSetWindowAttributes wattrs = {0};
@@ -288,7 +382,7 @@ ManageWindow(Window w, Bool mapped)
         tattrs.event_mask = HandleEventMask;
         tattrs.cursor = cursors[CursorNormal];
         c->topbar = XCreateWindow(display, c->frame, 0, 0, 1, 1, 0,
-                CopyFromParent, InputOnly, CopyFromParent,
+                CopyFromParent, InputOutput, CopyFromParent,
                 CWEventMask | CWCursor, &tattrs);
 
         /* buttons */
@@ -314,14 +408,18 @@ ManageWindow(Window w, Bool mapped)
         }
     }
 
+    /* new windows are created above the others */
+    c->stackOrder = ++stackCount;
+
     /* attach */
     AttachClient(c);
+    RegisterClient(c);
     SynchronizeFrameGeometry(c);
     AttachClientToMonitor(activeMonitor, c);
     ShowClient(c);
 
     /* place the window */
-    if (! c->monitor->desktops[c->desktop].isDynamic
+    if (! c->monitor->desktops[GetShownDesktop(c)].isDynamic
             && ! (c->types & NetWMTypeFixed)
             && ! (IsFixed(c->normals))) {
         if (c->states & (NetWMStateMaximized|NetWMStateFullscreen)) {
@@ -334,7 +432,7 @@ ManageWindow(Window w, Bool mapped)
                 FullscreenClient(c);
         } else {
             /* honor placement strategy if any */
-            Desktop *d = &c->monitor->desktops[c->desktop];
+            Desktop *d = &c->monitor->desktops[GetShownDesktop(c)];
             int nx = c->fx;
             int ny = c->fy;
             int nw = Min(c->fw, d->ww); 
@@ -344,14 +442,8 @@ ManageWindow(Window w, Bool mapped)
                 ny =  d->wy + (d->wh - nh) / 2;
             }
             if (settings.placement == StrategyPointer) {
-                Window rr, cr;
-                int rx, ry, wx, wy;
-                unsigned int mr;
-                if (XQueryPointer(display, w, &rr, &cr, &rx, &ry,
-                            &wx, &wy, &mr)) {
-                    nx = rx - nw / 2;
-                    ny = ry - nh / 2;
-                }
+                nx = px - nw / 2;
+                ny = py - nh / 2;
             }
             /* be sure to be fully visible */
             nx = Max(d->wx, Min(d->wx + d->ww - nw , nx));
@@ -383,19 +475,11 @@ ManageWindow(Window w, Bool mapped)
         for (int i = 0; i < HandleCount; ++i)
             XMapWindow(display, c->handles[i]);
 
-    if (c->hints & HintsFocusable && !(c->types & NetWMTypeFixed)) {
-        SetFocusedClient(c);
-        /* let anyone interrested in ewmh knows what we honor */
+    /* let anyone interrested in ewmh knows what we honor */
+    if (c->hints & HintsFocusable && !(c->types & NetWMTypeFixed))
         SetNetWMAllowedActions(w, NetWMActionDefault);
-    }
 
-    /* if dynamic we need to refresh the tiling */
-    if (c->monitor->desktops[c->desktop].isDynamic)
-        RefreshMonitor(c->monitor);
-
-    /* update the client list */
-    XChangeProperty(display, root, atoms[AtomNetClientList], XA_WINDOW,
-            32, PropModeAppend, (unsigned char *) &(w), 1);
+    return c;
 }
 
 void
@@ -408,6 +492,7 @@ UnmanageWindow(Window w, Bool destroyed)
         return;
 
     DLog("%ld destroyed: %d", w, destroyed);
+    EnterProbe(&unmanageWindowProbe);
 
     /* if some transients release them */
     t = c->transients;
@@ -435,10 +520,14 @@ UnmanageWindow(Window w, Bool destroyed)
     if (c == activeClient)
         activeClient = NULL;
 
-    if (c->monitor->desktops[c->desktop].activeOnLeave == c)
-        c->monitor->desktops[c->desktop].activeOnLeave = NULL;
+    /* stickies may have been left active on any desktop */
+    for (int i = 0; i < DesktopCount; ++i)
+        if (c->monitor->desktops[i].activeOnLeave == c)
+            c->monitor->desktops[i].activeOnLeave = NULL;
 
     DetachClientFromMonitor(c->monitor, c);
+    CancelClientRefresh(c);
+    UnregisterClient(c);
     DetachClient(c);
 
     if (c->name)
@@ -460,7 +549,7 @@ UnmanageWindow(Window w, Bool destroyed)
         //XChangeProperty(display, c->window, atoms[AtomWMState],
         //    atoms[AtomWMState], 32, PropModeReplace,
         //    (unsigned char *)state, 2);
-        XSync(display, False);
+        SyncDisplay(False);
         XSetErrorHandler(EnableErrorHandler);
         XUngrabServer(display);
     }
@@ -475,6 +564,7 @@ UnmanageWindow(Window w, Bool destroyed)
         for (int i = 0; i < HandleCount; ++i)
             XDestroyWindow(display, c->handles[i]);
 
+    ReleaseClientDecorations(c);
     XDestroyWindow(display, c->frame);
 
     if (destroyed)
@@ -482,31 +572,35 @@ UnmanageWindow(Window w, Bool destroyed)
 
     free(c);
 
-    /* update the client list */
-    XDeleteProperty(display, root, atoms[AtomNetClientList]);
-    for (Client *it = clients; it; it = it->next)
-        XChangeProperty(display, root, atoms[AtomNetClientList], XA_WINDOW, 32,
-                PropModeAppend, (unsigned char *) &it->window, 1);
-
     if (! activeClient)
         SetFocusedClient(NULL);
+
+    LeaveProbe(&unmanageWindowProbe);
 }
 
 Client *
 LookupClient(Window w)
 {
-    for (Client *c = clients; c; c = c->next) {
-        if (c->window == w || c->frame == w || c->topbar == w)
-            return c;
-
-        for (int i = 0; i < ButtonCount; ++i)
-            if (c->buttons[i] == w)
-                return c;
+    return LookupClientPart(w, NULL);
+}
 
-        for (int i = 0; i < HandleCount; ++i)
-            if (c->handles[i] == w)
-                return c;
-    };
+Client *
+LookupClientPart(Window w, int *part)
+{
+    if (part)
+        *part = PartNone;
+
+    if (!registryCount || w == None)
+        return NULL;
+
+    for (unsigned long i = (w * 2654435761UL) & (registrySize - 1);
+            registry[i].window != None; i = (i + 1) & (registrySize - 1)) {
+        if (registry[i].window == w) {
+            if (part)
+                *part = registry[i].part;
+            return registry[i].client;
+        }
+    }
     return NULL;
 }
 
@@ -520,6 +614,8 @@ void
 Reload()
 {
     LoadConfigFile();
+    CleanupDecorations();
+    SetupDecorations();
     for (Monitor *m = monitors; m; m = m->next) {
         for (int i = 0; i < DesktopCount; ++i) {
             m->desktops[i].masters = settings.masters;
@@ -528,6 +624,8 @@ Reload()
     }
 
     for (Client *c = clients; c; c = c->next) {
+        /* titles were shaped with the previous font */
+        ReleaseClientDecorations(c);
         SynchronizeWindowGeometry(c);
         ShowClient(c);
     }
@@ -567,6 +665,8 @@ SetFocusedClient(Client *c)
     if (activeClient && activeClient == n)
         return;
 
+    EnterProbe(&setFocusedClientProbe);
+
     /* we need to find a new one to activate */
     if (!n)  {
         if (lastActiveClient
@@ -601,6 +701,8 @@ SetFocusedClient(Client *c)
         /* otherwise let everybody know there's no more active client */
         XDeleteProperty(display, root, atoms[AtomNetActiveWindow]);
     }
+
+    LeaveProbe(&setFocusedClientProbe);
 }
 
 void
@@ -636,11 +738,36 @@ FocusPreviousClient()
     }
 }
 
+void
+PublishClientList()
+{
+    if (!isClientListDirty)
+        return;
+
+    XChangeProperty(display, root, atoms[AtomNetClientList], XA_WINDOW, 32,
+            PropModeReplace, (unsigned char *) clientList, clientListCount);
+    isClientListDirty = False;
+}
+
 void
 AttachClient(Client *c)
 {
     c->next = clients;
     clients = c;
+
+    /* the client list goes from the oldest to the newest client */
+    if (clientListCount == clientListSize) {
+        unsigned long n = clientListSize ? clientListSize * 2 : 64;
+        Window *l = realloc(clientList, n * sizeof(Window));
+        if (!l) {
+            ELog("can't grow client list.");
+            return;
+        }
+        clientList = l;
+        clientListSize = n;
+    }
+    clientList[clientListCount++] = c->window;
+    isClientListDirty = True;
 }
 
 void
@@ -649,5 +776,128 @@ DetachClient(Client *c)
     Client **tc;
     for (tc = &clients; *tc && *tc != c; tc = &(*tc)->next);
     *tc = c->next;
+
+    for (unsigned long i = 0; i < clientListCount; ++i) {
+        if (clientList[i] == c->window) {
+            memmove(&clientList[i], &clientList[i + 1],
+                    (clientListCount - i - 1) * sizeof(Window));
+            clientListCount--;
+            isClientListDirty = True;
+            break;
+        }
+    }
+}
+
+
+void
+RegisterClient(Client *c)
+{
+    RegisterWindow(c->window, c, PartWindow);
+    RegisterWindow(c->frame, c, PartFrame);
+
+    if (c->hasTopbar) {
+        RegisterWindow(c->topbar, c, PartTopbar);
+        for (int i = 0; i < ButtonCount; ++i)
+            RegisterWindow(c->buttons[i], c, PartButton + i);
+    }
+
+    if (c->hasHandles)
+        for (int i = 0; i < HandleCount; ++i)
+            RegisterWindow(c->handles[i], c, PartHandle + i);
+}
+
+void
+UnregisterClient(Client *c)
+{
+    UnregisterWindow(c->window);
+    UnregisterWindow(c->frame);
+
+    if (c->hasTopbar) {
+        UnregisterWindow(c->topbar);
+        for (int i = 0; i < ButtonCount; ++i)
+            UnregisterWindow(c->buttons[i]);
+    }
+
+    if (c->hasHandles)
+        for (int i = 0; i < HandleCount; ++i)
+            UnregisterWindow(c->handles[i]);
 }
 
+void
+RegisterWindow(Window w, Client *c, int part)
+{
+    unsigned long i;
+
+    /* keep the load factor under 1/2 so probing sequences stay short
+     * and there is always an empty slot to end them */
+    if ((registryCount + 1) * 2 > registrySize && !GrowRegistry()
+            && registryCount + 1 >= registrySize) {
+        ELog("can't register window %ld.", w);
+        return;
+    }
+
+    for (i = (w * 2654435761UL) & (registrySize - 1);
+            registry[i].window != None && registry[i].window != w;
+            i = (i + 1) & (registrySize - 1));
+
+    if (registry[i].window == None)
+        registryCount++;
+
+    registry[i].window = w;
+    registry[i].client = c;
+    registry[i].part = part;
+}
+
+void
+UnregisterWindow(Window w)
+{
+    unsigned long i, j, k;
+
+    if (!registryCount || w == None)
+        return;
+
+    for (i = (w * 2654435761UL) & (registrySize - 1);
+            registry[i].window != w; i = (i + 1) & (registrySize - 1))
+        if (registry[i].window == None)
+            return;
+
+    /* backward shift the following entries of the cluster instead
+     * of leaving a tombstone behind */
+    for (j = (i + 1) & (registrySize - 1); registry[j].window != None;
+            j = (j + 1) & (registrySize - 1)) {
+        k = (registry[j].window * 2654435761UL) & (registrySize - 1);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            registry[i] = registry[j];
+            i = j;
+        }
+    }
+
+    registry[i].window = None;
+    registry[i].client = NULL;
+    registry[i].part = PartNone;
+    registryCount--;
+}
+
+Bool
+GrowRegistry()
+{
+    Registration *old = registry;
+    unsigned long size = registrySize;
+    unsigned long n = size ? size * 2 : RegistryMinSize;
+
+    registry = calloc(n, sizeof(Registration));
+    if (!registry) {
+        ELog("can't allocate registry.");
+        registry = old;
+        return False;
+    }
+
+    registrySize = n;
+    registryCount = 0;
+    for (unsigned long i = 0; i < size; ++i)
+        if (old[i].window != None)
+            RegisterWindow(old[i].window, old[i].client, old[i].part);
+
+    free(old);
+    return True;
+}
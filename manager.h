@@ -15,6 +15,8 @@ void CleanupWindowManager();
 void ManageWindow(Window w, Bool mapped);
 void UnmanageWindow(Window w, Bool destroyed);
 Client *LookupClient(Window w);
+Client *LookupClientPart(Window w, int *part);
+void PublishClientList();
 
 void Quit();
 void Reload();
@@ -0,0 +1,237 @@
+#include <time.h>
+
+#include <X11/Xlib.h>
+
+#include "log.h"
+#include "macros.h"
+#include "metrics.h"
+#include "x11.h"
+
+static void DumpHistogram(const char *name, Histogram *h, Cost *c);
+static void AddCost(Cost *c, unsigned long request, unsigned long roundTrip);
+static unsigned long Percentile(Histogram *h, int p);
+
+static char *eventNames[LASTEvent] = {
+    [KeyPress] = "KeyPress",
+    [KeyRelease] = "KeyRelease",
+    [ButtonPress] = "ButtonPress",
+    [ButtonRelease] = "ButtonRelease",
+    [MotionNotify] = "MotionNotify",
+    [EnterNotify] = "EnterNotify",
+    [LeaveNotify] = "LeaveNotify",
+    [FocusIn] = "FocusIn",
+    [FocusOut] = "FocusOut",
+    [KeymapNotify] = "KeymapNotify",
+    [Expose] = "Expose",
+    [GraphicsExpose] = "GraphicsExpose",
+    [NoExpose] = "NoExpose",
+    [VisibilityNotify] = "VisibilityNotify",
+    [CreateNotify] = "CreateNotify",
+    [DestroyNotify] = "DestroyNotify",
+    [UnmapNotify] = "UnmapNotify",
+    [MapNotify] = "MapNotify",
+    [MapRequest] = "MapRequest",
+    [ReparentNotify] = "ReparentNotify",
+    [ConfigureNotify] = "ConfigureNotify",
+    [ConfigureRequest] = "ConfigureRequest",
+    [GravityNotify] = "GravityNotify",
+    [ResizeRequest] = "ResizeRequest",
+    [CirculateNotify] = "CirculateNotify",
+    [CirculateRequest] = "CirculateRequest",
+    [PropertyNotify] = "PropertyNotify",
+    [SelectionClear] = "SelectionClear",
+    [SelectionRequest] = "SelectionRequest",
+    [SelectionNotify] = "SelectionNotify",
+    [ColormapNotify] = "ColormapNotify",
+    [ClientMessage] = "ClientMessage",
+    [MappingNotify] = "MappingNotify",
+    [GenericEvent] = "GenericEvent"
+};
+
+/* the latencies are in us, extension events share the last slot,
+ * client messages are keyed by atom with unknown ones last */
+static Histogram events[LASTEvent + 1];
+static Histogram messages[AtomCount + 1];
+static Histogram depths;
+static Cost eventCosts[LASTEvent + 1];
+static Cost messageCosts[AtomCount + 1];
+static char *latencyNames[LatencyCount] = {
+    [LatencyDesktopSwitch] = "desktop switch"
+};
+
+static unsigned long uploads[UploadPathCount];
+static Histogram latencies[LatencyCount];
+static Probe *probes = NULL;
+static long eventStart;
+static unsigned long eventRequest;
+static unsigned long eventRoundTrip;
+
+long
+Timestamp()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+BeginEvent()
+{
+    eventStart = Timestamp();
+    eventRequest = NextRequest(display);
+    eventRoundTrip = roundTripCount;
+}
+
+void
+EndEvent(XEvent *e)
+{
+    int i = e->type < LASTEvent ? e->type : LASTEvent;
+    long us = Timestamp() - eventStart;
+
+    if (us < 0)
+        us = 0;
+
+    RecordValue(&events[i], us);
+    AddCost(&eventCosts[i], eventRequest, eventRoundTrip);
+
+    if (e->type == ClientMessage) {
+        for (i = 0; i < AtomCount && atoms[i] != e->xclient.message_type; ++i);
+        RecordValue(&messages[i], us);
+        AddCost(&messageCosts[i], eventRequest, eventRoundTrip);
+    }
+}
+
+void
+EnterProbe(Probe *p)
+{
+    if (p->depth++)
+        return;
+
+    if (!p->cost.calls && !p->next && p != probes) {
+        p->next = probes;
+        probes = p;
+    }
+
+    p->request = NextRequest(display);
+    p->roundTrip = roundTripCount;
+}
+
+void
+LeaveProbe(Probe *p)
+{
+    if (--p->depth)
+        return;
+
+    AddCost(&p->cost, p->request, p->roundTrip);
+}
+
+void
+RecordQueueDepth(int depth)
+{
+    RecordValue(&depths, depth > 0 ? depth : 0);
+}
+
+void
+RecordValue(Histogram *h, unsigned long v)
+{
+    int b = 0;
+
+    /* bucket b holds the values below 2^b */
+    while (b < HistogramBuckets - 1 && v >> b)
+        b++;
+
+    h->buckets[b]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+void
+RecordUpload(int path)
+{
+    uploads[path]++;
+}
+
+void
+RecordLatency(int action, long us)
+{
+    RecordValue(&latencies[action], us > 0 ? us : 0);
+}
+
+void
+DumpMetrics()
+{
+    char name[64];
+
+    ILog("latencies in us, bucket upper bounds for percentiles, "
+            "X requests and round trips:");
+    for (int i = 0; i <= LASTEvent; ++i) {
+        if (!events[i].count)
+            continue;
+        snprintf(name, sizeof(name), "event %s",
+                i < LASTEvent && eventNames[i] ? eventNames[i] : "Extension");
+        DumpHistogram(name, &events[i], &eventCosts[i]);
+    }
+
+    for (int i = 0; i <= AtomCount; ++i) {
+        if (!messages[i].count)
+            continue;
+
+        if (i < AtomCount) {
+            char *an = XGetAtomName(display, atoms[i]);
+            snprintf(name, sizeof(name), "message %s", an ? an : "?");
+            if (an)
+                XFree(an);
+        } else {
+            snprintf(name, sizeof(name), "message other");
+        }
+        DumpHistogram(name, &messages[i], &messageCosts[i]);
+    }
+
+    DumpHistogram("queue depth", &depths, NULL);
+    for (int i = 0; i < LatencyCount; ++i)
+        if (latencies[i].count)
+            DumpHistogram(latencyNames[i], &latencies[i], NULL);
+    ILog("%-40s shm=%lu xlib=%lu", "uploads", uploads[UploadShm],
+            uploads[UploadXlib]);
+
+    for (Probe *p = probes; p; p = p->next)
+        ILog("%-40s n=%lu requests=%lu round-trips=%lu", p->name,
+                p->cost.calls, p->cost.requests, p->cost.roundTrips);
+    fflush(stdout);
+}
+
+void
+DumpHistogram(const char *name, Histogram *h, Cost *c)
+{
+    if (c)
+        ILog("%-40s n=%lu p50=%lu p99=%lu max=%lu requests=%lu round-trips=%lu",
+                name, h->count, Percentile(h, 50), Percentile(h, 99), h->max,
+                c->requests, c->roundTrips);
+    else
+        ILog("%-40s n=%lu p50=%lu p99=%lu max=%lu", name, h->count,
+                Percentile(h, 50), Percentile(h, 99), h->max);
+}
+
+void
+AddCost(Cost *c, unsigned long request, unsigned long roundTrip)
+{
+    c->calls++;
+    c->requests += NextRequest(display) - request;
+    c->roundTrips += roundTripCount - roundTrip;
+}
+
+unsigned long
+Percentile(Histogram *h, int p)
+{
+    unsigned long n = 0;
+    unsigned long rank = (h->count * p + 99) / 100;
+
+    for (int b = 0; b < HistogramBuckets; ++b) {
+        n += h->buckets[b];
+        if (n >= rank && n && b < HistogramBuckets - 1)
+            return Min((1UL << b) - 1, h->max);
+    }
+    return h->max;
+}
@@ -0,0 +1,62 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <X11/Xlib.h>
+
+/* log2 buckets, the last one catches everything above */
+#define HistogramBuckets 32
+
+/* how client side rendered images reach the server */
+enum UploadPaths {
+    UploadShm,
+    UploadXlib,
+    UploadPathCount
+};
+
+/* latencies of compound actions */
+enum Latencies {
+    LatencyDesktopSwitch,
+    LatencyCount
+};
+
+typedef struct Histogram Histogram;
+typedef struct Cost Cost;
+typedef struct Probe Probe;
+
+struct Histogram {
+    unsigned long count;
+    unsigned long max;
+    unsigned long buckets[HistogramBuckets];
+};
+
+/* X traffic caused by a code path */
+struct Cost {
+    unsigned long calls;
+    unsigned long requests;
+    unsigned long roundTrips;
+};
+
+/* a function whose X traffic is accounted, only the outermost of
+ * nested calls is measured. Probes link themselves on first use */
+struct Probe {
+    char *name;
+    Cost cost;
+    unsigned long request;
+    unsigned long roundTrip;
+    int depth;
+    Probe *next;
+};
+
+long Timestamp();
+
+void BeginEvent();
+void EndEvent(XEvent *e);
+void EnterProbe(Probe *p);
+void LeaveProbe(Probe *p);
+void RecordQueueDepth(int depth);
+void RecordValue(Histogram *h, unsigned long v);
+void RecordUpload(int path);
+void RecordLatency(int action, long us);
+void DumpMetrics();
+
+#endif /* __METRICS_H__ */
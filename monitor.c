@@ -11,6 +11,7 @@
 #include "log.h"
 #include "macros.h"
 #include "manager.h"
+#include "metrics.h"
 #include "monitor.h"
 #include "settings.h"
 #include "x11.h"
@@ -21,9 +22,14 @@ static Bool XineramaScanMonitors();
 static Bool XRandRScanMonitors();
 static void StackClientFront(Monitor *m, Client *c);
 static void StackClientBack(Monitor *m, Client *c);
+static void LayoutMonitor(Monitor *m, Bool settle);
+static void RestackMonitor(Monitor *m);
+static int CompareStackOrder(const void *a, const void *b);
 
 Monitor *monitors = NULL;
 
+static Probe layoutMonitorProbe = { .name = "LayoutMonitor" };
+
 Bool
 SetupMonitors()
 {
@@ -41,6 +47,8 @@ SetupMonitors()
             if (!monitors) FLog("can't allocate monitor");
             monitors->head= NULL;
             monitors->tail= NULL;
+            monitors->isLayoutDirty = False;
+            monitors->stackedCount = 0;
             monitors->next = NULL;
         }
         if (monitors->w != DisplayWidth(display, DefaultScreen(display))
@@ -127,7 +135,6 @@ void
 DetachClientFromMonitor(Monitor *m, Client *c)
 {
     int desktop = c->desktop;
-    Desktop *d = &m->desktops[desktop];
 
     if (c->monitor != m)
         return;
@@ -145,18 +152,10 @@ DetachClientFromMonitor(Monitor *m, Client *c)
     c->snext = NULL;
     c->sprev = NULL;
 
-    if (c->strut.right || c->strut.left || c->strut.top || c->strut.bottom) {
-        d->wx = m->x;
-        d->wy = m->y;
-        d->ww = m->w;
-        d->wh = m->h;
-        for (Client *mc = m->head; mc; mc = mc->snext) {
-            d->wx = Max(d->wx, m->x + mc->strut.left);
-            d->wy = Max(d->wy, m->y + mc->strut.top);
-            d->ww = Min(d->ww, m->w - (mc->strut.right + mc->strut.left));
-            d->wh = Min(d->wh, m->h - (mc->strut.top + mc->strut.bottom));
-        }
-    }
+    if (c->strut.right || c->strut.left || c->strut.top || c->strut.bottom)
+        for (int i = 0; i < DesktopCount; ++i)
+            if (i == desktop || c->states & NetWMStateSticky)
+                UpdateDesktopWorkArea(m, i);
 
     c->monitor = NULL;
     c->desktop = -1;
@@ -175,19 +174,20 @@ ShowMonitorDesktop(Monitor *m, int desktop)
     if (desktop < 0 || desktop >= DesktopCount || m->activeDesktop == desktop)
         return;
 
+    long start = Timestamp();
+
     m->desktops[m->activeDesktop].activeOnLeave = activeClient;
     m->activeDesktop = desktop;
 
-    /* assign all stickies to this desktop */
-    for (Client *c = m->head; c; c = c->snext)
-        if (c->states & NetWMStateSticky)
-            MoveClientToDesktop(c, desktop);
-
+    /* stickies are on every desktop, they are left alone */
     SetFocusedClient(m->desktops[m->activeDesktop].activeOnLeave);
-    RefreshMonitor(m);
     XChangeProperty(display, root, atoms[AtomNetCurrentDesktop],
             XA_CARDINAL, 32, PropModeReplace, (unsigned char *)&desktop, 1);
 
+    /* the switch is not deferred, it is laid out as one transaction */
+    m->isLayoutDirty = False;
+    LayoutMonitor(m, True);
+    RecordLatency(LatencyDesktopSwitch, Timestamp() - start);
 }
 
 void
@@ -284,9 +284,9 @@ SetMonitorDesktopTopbar(Monitor *m, int desktop, Bool b)
 {
     m->desktops[desktop].showTopbars = b;
     for (Client *c = m->head; c; c = c->snext) {
-        if (c->desktop == desktop)
+        if (IsClientOnDesktop(c, desktop))
             SetClientTopbarVisible(c, b);
-        RefreshClient(c);
+        InvalidateClient(c);
     }
     RefreshMonitor(m);
 }
@@ -377,28 +377,28 @@ StackClientDown(Monitor *m, Client *c)
 
     Client *after = NULL;
     for (after = c->snext;
-            after && (after->desktop != c->desktop
+            after && (!IsClientOnDesktop(after, m->activeDesktop)
                 || !(after->types & NetWMTypeNormal)
                 ||  after->states & NetWMStateHidden);
             after = after->snext);
 
     if (after) {
         StackClientAfter(m, c, after);
-        if (m->desktops[c->desktop].isDynamic)
+        if (m->desktops[GetShownDesktop(c)].isDynamic)
             RefreshMonitor(c->monitor);
         return;
     }
 
     Client *before = NULL;
     for (before = c->monitor->head;
-            before && (before->desktop != c->desktop
+            before && (!IsClientOnDesktop(before, m->activeDesktop)
                 || !(before->types & NetWMTypeNormal)
                 ||  before->states & NetWMStateHidden);
             before = before->snext);
 
     if (before) {
         StackClientBefore(m, c, before);
-        if (m->desktops[c->desktop].isDynamic)
+        if (m->desktops[GetShownDesktop(c)].isDynamic)
             RefreshMonitor(c->monitor);
     }
 }
@@ -411,28 +411,28 @@ StackClientUp(Monitor *m, Client *c)
 
     Client *before = NULL;
     for (before = c->sprev;
-                    before && (before->desktop != c->desktop
+                    before && (!IsClientOnDesktop(before, m->activeDesktop)
                     || !(before->types & NetWMTypeNormal)
                     ||  before->states & NetWMStateHidden);
             before = before->sprev);
 
     if (before) {
         StackClientBefore(m, c, before);
-        if (m->desktops[c->desktop].isDynamic)
+        if (m->desktops[GetShownDesktop(c)].isDynamic)
             RefreshMonitor(m);
         return;
     }
 
     Client *after = NULL;
     for (after = c->monitor->tail;
-                    after && (after->desktop != c->desktop
+                    after && (!IsClientOnDesktop(after, m->activeDesktop)
                     || !(after->types & NetWMTypeNormal)
                     ||  after->states & NetWMStateHidden);
             after = after->sprev);
 
     if (after) {
         StackClientAfter(m, c, after);
-        if (m->desktops[c->desktop].isDynamic)
+        if (m->desktops[GetShownDesktop(c)].isDynamic)
             RefreshMonitor(c->monitor);
     }
 }
@@ -453,24 +453,75 @@ StackClientBottom(Monitor *m, Client *c)
     StackClientAfter(m, c, m->tail);
 }
 
+void
+UpdateDesktopWorkArea(Monitor *m, int desktop)
+{
+    Desktop *d = &m->desktops[desktop];
+
+    d->wx = m->x;
+    d->wy = m->y;
+    d->ww = m->w;
+    d->wh = m->h;
+    for (Client *mc = m->head; mc; mc = mc->snext) {
+        if (IsClientOnDesktop(mc, desktop)) {
+            d->wx = Max(d->wx, m->x + mc->strut.left);
+            d->wy = Max(d->wy, m->y + mc->strut.top);
+            d->ww = Min(d->ww, m->w - (mc->strut.right + mc->strut.left));
+            d->wh = Min(d->wh, m->h - (mc->strut.top + mc->strut.bottom));
+        }
+    }
+}
+
 void
 RefreshMonitor(Monitor *m)
 {
-    /* hide clients */
+    /* compound actions refresh the same monitor many times, it is
+     * laid out once when the event batch is over */
+    m->isLayoutDirty = True;
+}
+
+void
+RefreshDirtyMonitors()
+{
+    for (Monitor *m = monitors; m; m = m->next) {
+        if (m->isLayoutDirty) {
+            m->isLayoutDirty = False;
+            LayoutMonitor(m, False);
+        }
+    }
+}
+
+void
+LayoutMonitor(Monitor *m, Bool settle)
+{
+    Desktop *d = &m->desktops[m->activeDesktop];
+    /* raised, lowered or shown clients change the stacking order */
+    Bool restack = settle || m->stackedCount != stackCount;
+
+    EnterProbe(&layoutMonitorProbe);
+
+    /* what changed while hidden is requested before the grab and
+     * received when the batch is over */
+    for (Client *c = m->head; c; c = c->snext)
+        if (c->stale && IsClientOnDesktop(c, m->activeDesktop))
+            RequestStaleProperties(c);
+
+    /* hide, place and restack in a single grab, only what changed
+     * is sent */
     XGrabServer(display);
     for (Client *c = m->head; c; c = c->snext)
-        if (c->desktop != m->activeDesktop)
+        if (!IsClientOnDesktop(c, m->activeDesktop))
             HideClient(c);
-    XUngrabServer(display);
 
     /* if isDynamic mode is enabled re-tile the desktop */
-    if (m->desktops[m->activeDesktop].isDynamic) {
-        XEvent e;
+    if (d->isDynamic) {
         Client *c;
         int n = 0, mw = 0, i = 0, mx = 0, ty = 0;
 
+        /* stickies are above the tiles of every desktop */
         for (c = m->head; c; c = c->snext) {
             if (c->desktop == m->activeDesktop
+                    && !(c->states & NetWMStateSticky)
                     && !(c->types & NetWMTypeFixed)
                     && !c->transfor) {
                 if (c->states & NetWMStateHidden)
@@ -479,7 +530,6 @@ RefreshMonitor(Monitor *m)
             }
         }
 
-        Desktop *d = &m->desktops[m->activeDesktop];
         if (n > d->masters)
             mw = d->masters ? d->ww * d->split : 0;
         else
@@ -487,6 +537,7 @@ RefreshMonitor(Monitor *m)
 
         for (c = m->head; c; c = c->snext) {
             if (c->desktop == m->activeDesktop
+                    && !(c->states & NetWMStateSticky)
                     && !(c->types & NetWMTypeFixed)
                     && !(IsFixed(c->normals))
                     && !c->transfor) {
@@ -503,22 +554,94 @@ RefreshMonitor(Monitor *m)
                 }
                 i++;
             }
-            if (c->desktop == m->activeDesktop
+            if (c->states & NetWMStateSticky) {
+                /* left alone once shown */
+                if (!c->isVisible && !(c->states & NetWMStateHidden)) {
+                    restack = True;
+                    ShowClient(c);
+                }
+            } else if (c->desktop == m->activeDesktop
                     || (c->types & NetWMTypeFixed)
                     || (IsFixed(c->normals))
                     || c->transfor) {
+                restack |= !c->isVisible;
                 ShowClient(c);
             }
-        } 
-        /* avoid having enter notify event changing active client */
-        XSync(display, False);
-        while (XCheckMaskEvent(display, EnterWindowMask, &e));
+        }
     } else {
         for (Client *c = m->head; c; c = c->snext)
-            if (c->desktop == m->activeDesktop
-                    && !(c->states & NetWMStateHidden))
+            if (IsClientOnDesktop(c, m->activeDesktop)
+                    && !(c->states & NetWMStateHidden)
+                    && !(c->states & NetWMStateSticky && c->isVisible)) {
+                restack |= !c->isVisible;
                 ShowClient(c);
+            }
+    }
+
+    if (restack)
+        RestackMonitor(m);
+    XUngrabServer(display);
+
+    /* avoid having enter notify event changing active client */
+    if (settle || d->isDynamic) {
+        XEvent e;
+        SyncDisplay(False);
+        while (XCheckMaskEvent(display, EnterWindowMask, &e));
+    }
+    LeaveProbe(&layoutMonitorProbe);
+}
+
+void
+RestackMonitor(Monitor *m)
+{
+    Client **visible;
+    Window *windows;
+    int n = 0, nw = 0;
+
+    m->stackedCount = stackCount;
+    for (Client *c = m->head; c; c = c->snext)
+        if (IsClientOnDesktop(c, m->activeDesktop))
+            n++;
+
+    if (!n)
+        return;
+
+    visible = malloc(n * sizeof(Client *));
+    windows = malloc(n * (HandleCount + 1) * sizeof(Window));
+    if (!visible || !windows) {
+        ELog("can't allocate stacking order");
+        free(visible);
+        free(windows);
+        return;
     }
+
+    n = 0;
+    for (Client *c = m->head; c; c = c->snext)
+        if (IsClientOnDesktop(c, m->activeDesktop))
+            visible[n++] = c;
+
+    /* restore the order raises and lowers left, top first with the
+     * handles above their frame, in one request */
+    qsort(visible, n, sizeof(Client *), CompareStackOrder);
+    for (int i = 0; i < n; ++i) {
+        if (visible[i]->hasHandles)
+            for (int j = HandleCount - 1; j >= 0; --j)
+                windows[nw++] = visible[i]->handles[j];
+        windows[nw++] = visible[i]->frame;
+    }
+    XRestackWindows(display, windows, nw);
+
+    free(windows);
+    free(visible);
+}
+
+int
+CompareStackOrder(const void *a, const void *b)
+{
+    long oa = (*(Client **)a)->stackOrder;
+    long ob = (*(Client **)b)->stackOrder;
+
+    return oa < ob ? 1 : oa > ob ? -1 : 0;
 }
 
 Bool
@@ -548,9 +671,12 @@ XineramaScanMonitors()
     Bool dirty = False;
     Client *c;
     Monitor *m;
-    XineramaScreenInfo *info = XineramaQueryScreens(display, &nn);
+    XineramaScreenInfo *info;
     XineramaScreenInfo *unique = NULL;
 
+    roundTripCount++;
+    info = XineramaQueryScreens(display, &nn);
+
     for (n = 0, m = monitors; m; m = m->next, n++);
     /* only consider unique geometries as separate screens */
     unique = malloc(nn *  sizeof(XineramaScreenInfo));
@@ -629,6 +755,7 @@ XRandRScanMonitors()
     XRRCrtcInfo *unique = NULL;
 
     /* scan for monitors */
+    roundTripCount++;
     sr = XRRGetScreenResources(display, root);
 
     for (n = 0, m = monitors; m; m = m->next, n++);
@@ -636,7 +763,9 @@ XRandRScanMonitors()
     unique = malloc(sr->ncrtc * sizeof(XRRCrtcInfo));
     if (! unique) FLog("can't allocate memory for screen info");
     for (i = 0, j = 0; i < sr->ncrtc; i++) {
-        XRRCrtcInfo *ci = XRRGetCrtcInfo(display, sr, sr->crtcs[i]);
+        XRRCrtcInfo *ci;
+        roundTripCount++;
+        ci = XRRGetCrtcInfo(display, sr, sr->crtcs[i]);
         if (ci != NULL && ci->noutput != 0 && IsXRandRScreenUnique(unique, j, ci))
             memcpy(&unique[j++], ci, sizeof(XRRCrtcInfo));
         XRRFreeCrtcInfo(ci);
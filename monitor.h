@@ -25,6 +25,8 @@ struct Monitor {
     int activeDesktop;
     Client *head;
     Client *tail;
+    Bool isLayoutDirty;     /* laid out again when the batch is over    */
+    long stackedCount;      /* stackCount when last restacked           */
     Monitor *next;
 };
 
@@ -68,6 +70,8 @@ void StackClientUp(Monitor *m, Client *c);
 void StackClientTop(Monitor *m, Client *c);
 void StackClientBottom(Monitor *m, Client *c);
 
+void UpdateDesktopWorkArea(Monitor *m, int desktop);
 void RefreshMonitor(Monitor *m);
+void RefreshDirtyMonitors();
 
 #endif /* __MONITOR_H__ */
@@ -103,6 +103,8 @@ Settings settings = {
     /* global */
     .snapping = 20,
     .placement = StrategyNone,
+    .titleInterval = 33,
+    .unmapHidden = False,
     /* dynamic desktops */
     .focusFollowsPointer    = False,
     .decorateTiles          = True,
@@ -237,6 +239,8 @@ static struct {
     {"MinimizeInactiveHoveredBorder",       (void*)&settings.buttonStyles[2].inactiveHoveredBorder,     SetColValue},
     {"Snapping",                            (void*)&settings.snapping,                                  SetIntValue},
     {"Placement",                           (void*)&settings.placement,                                 SetPlacementValue},
+    {"TitleInterval",                       (void*)&settings.titleInterval,                             SetIntValue},
+    {"UnmapHidden",                         (void*)&settings.unmapHidden,                               SetBoolValue},
     {"FocusFollowsPointer",                 (void*)&settings.focusFollowsPointer,                       SetBoolValue},
     {"DecorateTiles",                       (void*)&settings.decorateTiles,                             SetBoolValue},
     {"Masters",                             (void*)&settings.masters,                                   SetIntValue},
@@ -67,6 +67,8 @@ typedef struct Settings {
     /* global */
     int snapping;
     int placement;
+    int titleInterval;
+    Bool unmapHidden;
     /* dynamic */
     Bool focusFollowsPointer;
     Bool decorateTiles;
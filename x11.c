@@ -1,8 +1,11 @@
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcbext.h>
 #include <X11/Xproto.h>
 #include <X11/cursorfont.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/XShm.h>
 
 #include "log.h"
 #include "settings.h"
@@ -110,11 +113,17 @@ static unsigned int cursorIds[] = {
 };
 
 Display *display;
+xcb_connection_t *connection;
 int extensions;
+int shmCompletionType = -1;
+int shmOpcode = -1;
 Window root;
 unsigned long numLockMask;
 Atom atoms[AtomCount];
 Cursor cursors[CursorCount];
+unsigned long flushCount = 0;
+unsigned long syncCount = 0;
+unsigned long roundTripCount = 0;
 
 void
 SetupX11()
@@ -128,12 +137,21 @@ SetupX11()
     if (! display)
         FLog("Can't open display.");
 
+    /* used to send requests without waiting for their replies */
+    connection = XGetXCBConnection(display);
+
     /* check for extensions */
     extensions = ExtentionNone;
     if (XRRQueryExtension(display, &xreb, &ebr))
         extensions |= ExtentionXRandR;
     if (XineramaQueryExtension(display, &xreb, &ebr))
         extensions |= ExtentionXinerama;
+    if (XShmQueryExtension(display)) {
+        extensions |= ExtentionShm;
+        shmCompletionType = XShmGetEventBase(display) + ShmCompletion;
+        /* tells the errors of its requests */
+        XQueryExtension(display, SHMNAME, &shmOpcode, &xreb, &ebr);
+    }
 
     /* get the root window */
     root = RootWindow(display, DefaultScreen(display));
@@ -165,3 +183,31 @@ CleanupX11()
     XSync(display, False);
     XCloseDisplay(display);
 }
+
+void
+FlushDisplay()
+{
+    flushCount++;
+    XFlush(display);
+}
+
+void
+SyncDisplay(Bool discard)
+{
+    syncCount++;
+    roundTripCount++;
+    XSync(display, discard);
+}
+
+void *
+WaitForReply(unsigned int sequence, xcb_generic_error_t **e)
+{
+    void *r = NULL;
+
+    /* only count it if the reply is not already there */
+    if (xcb_poll_for_reply(connection, sequence, &r, e))
+        return r;
+
+    roundTripCount++;
+    return xcb_wait_for_reply(connection, sequence, e);
+}
@@ -3,6 +3,7 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
+#include <xcb/xcb.h>
 
 typedef enum AtomType AtomType;
 typedef enum CursorType CursorType;
@@ -116,17 +117,27 @@ enum CursorType {
 enum Extention {
     ExtentionNone       = 0,
     ExtentionXRandR     = (1 << 1),
-    ExtentionXinerama   = (1 << 2)
+    ExtentionXinerama   = (1 << 2),
+    ExtentionShm        = (1 << 3)
 };
 
 extern Display *display;
+extern xcb_connection_t *connection;
 extern int extensions;
+extern int shmCompletionType;
+extern int shmOpcode;
 extern Window root;
 extern unsigned long numLockMask;
 extern Atom atoms[AtomCount];
 extern Cursor cursors[CursorCount];
+extern unsigned long flushCount;
+extern unsigned long syncCount;
+extern unsigned long roundTripCount;    /* counted where a call waits */
 
 void SetupX11();
 void CleanupX11();
+void FlushDisplay();
+void SyncDisplay(Bool discard);
+void *WaitForReply(unsigned int sequence, xcb_generic_error_t **e);
 
 #endif /* __X11_H__ */